@@ -26,6 +26,12 @@ static Benchmark *getBenchmark(Config conf, int workerid = 0)
 	case UPSERT:
 		// printf("Benchmark: YCSB (Upsert)\n");
 		return new Upsert(conf);
+	case SCAN_ONLY:
+		// printf("Benchmark: Scan\n");
+		return new ScanBench(conf);
+	case SCAN_REVERSE_ONLY:
+		// printf("Benchmark: Reverse scan\n");
+		return new ScanReverseBench(conf);
 	default:
 		printf("none support benchmark %d\n", conf.benchmark);
 		exit(0);
@@ -20,6 +20,7 @@ enum DataDistrubute
 {
   RANDOM,
   ZIPFIAN,
+  SEQUENTIAL,
   _DataDistrbuteNumber
 };
 
@@ -31,6 +32,8 @@ enum BenchMarkType
   DELETE_ONLY,
   YCSB_A,
   UPSERT,
+  SCAN_ONLY,
+  SCAN_REVERSE_ONLY,
   _BenchMarkType
 };
 
@@ -54,6 +57,17 @@ struct Config
   int throughput;
   bool latency_test;
   int interval;
+  bool recover; // rebuild the tree from the pool instead of warming up
+  float bulk_load; // fill factor of the bulk loaded warm-up tree, 0 inserts the keys one by one
+  int batch;       // lookups (inserts) a worker hands to multi_search (insert_batch) at once, 1 runs every key alone
+  int htm_retries; // transaction attempts of an elided lock after the first one
+  int htm_backoff; // pause iterations before the first retry, doubled for every further one
+  int leaf_cache;  // leaves a thread remembers across operations, 0 goes through the inner nodes every time
+  int pm_domain;   // pm_domain_t: 0 eADR, 1 ADR, 2 volatile
+  bool xpline_stripe; // inserts into one leaf from different threads go to different XPLines
+  bool media_model;   // count the PM media writes of the benchmark in a model of the DIMM buffer
+  float compact_ratio; // a full leaf with a smaller share of live slots is compacted instead of split
+  float merge_ratio;   // a leaf a remove leaves with a smaller share of live slots is merged with a neighbour
 
   void report()
   {
@@ -77,6 +91,17 @@ static struct option opts[] = {
     {"skewness", required_argument, NULL, 'S'},
     {"scan_length", required_argument, NULL, 'l'},
     {"read_ratio", required_argument, NULL, 'r'},
+    {"recover", no_argument, NULL, 'R'},
+    {"bulk_load", required_argument, NULL, 'L'},
+    {"batch", required_argument, NULL, 'B'},
+    {"htm_retries", required_argument, NULL, 'H'},
+    {"htm_backoff", required_argument, NULL, 'W'},
+    {"leaf_cache", required_argument, NULL, 'C'},
+    {"pm_domain", required_argument, NULL, 'P'},
+    {"xpline_stripe", no_argument, NULL, 'X'},
+    {"media_model", no_argument, NULL, 'M'},
+    {"compact_ratio", required_argument, NULL, 'c'},
+    {"merge_ratio", required_argument, NULL, 'm'},
 };
 
 static void usage_exit(FILE *out)
@@ -89,10 +114,21 @@ static void usage_exit(FILE *out)
                "   -s --non_share_memory  : Use different index instances among different workers\n"
                "   -d --duration          : Execution time\n"
                "   -b --benchmark         : Benchmark type, 0-%d\n"
-               "   -w --workload          : type of workload: 0 (RANDOM) 1 (ZIPFIAN)\n"
+               "   -w --workload          : type of workload: 0 (RANDOM) 1 (ZIPFIAN) 2 (SEQUENTIAL)\n"
                "   -S --skewed            : skewness: 0-1 (default 0.99)\n"
                "   -l --scan_length       : scan_length: int (default 100)\n"
-               "   -r --read_ratio        : read ratio: int (default 50)\n",
+               "   -r --read_ratio        : read ratio: int (default 50)\n"
+               "   -R --recover           : Recover the tree in the pool instead of warming up\n"
+               "   -L --bulk_load         : Bulk load the warm-up keys with this fill factor: 0-1 (default 0, insert them)\n"
+               "   -B --batch             : Lookups (inserts) batched into one multi_search (insert_batch): int (default 1)\n"
+               "   -H --htm_retries       : Transaction retries before an elided lock is taken: int (default 8)\n"
+               "   -W --htm_backoff       : Pause iterations before the first transaction retry: int (default 16)\n"
+               "   -C --leaf_cache        : Leaves a thread remembers to skip the inner nodes: 0-16 (default 0)\n"
+               "   -P --pm_domain         : Persistence domain: 0 (eADR) 1 (ADR) 2 (volatile) (default 0)\n"
+               "   -X --xpline_stripe     : Stripe the inserts of different threads over the XPLines of a leaf\n"
+               "   -M --media_model       : Report the PM media writes of the benchmark, counted in a model of the DIMM buffer\n"
+               "   -c --compact_ratio     : Compact a full leaf into one leaf instead of splitting it below this share of live slots: 0-1 (default 0.5)\n"
+               "   -m --merge_ratio       : Merge a leaf with a neighbour once removes leave it below this share of live slots: 0-0.5 (default 0.25)\n",
           _BenchMarkType - 1);
   exit(EXIT_FAILURE);
 }
@@ -115,12 +151,23 @@ static void parse_arguments(int argc, char *argv[], Config &state)
   state.throughput = 10000000;
   state.latency_test = true;
   state.interval = 2;
+  state.recover = false;
+  state.bulk_load = 0;
+  state.batch = 1;
+  state.htm_retries = 8;
+  state.htm_backoff = 16;
+  state.leaf_cache = 0;
+  state.pm_domain = 0;
+  state.xpline_stripe = false;
+  state.media_model = false;
+  state.compact_ratio = 0.5;
+  state.merge_ratio = 0.25;
 
   // Parse args
   while (1)
   {
     int idx = 0;
-    int c = getopt_long(argc, argv, "f:t:n:k:sd:b:w:S:l:r:T:I:", opts,
+    int c = getopt_long(argc, argv, "f:t:n:k:sd:b:w:S:l:r:T:I:RL:B:H:W:C:P:XMc:m:", opts,
                         &idx);
 
     if (c == -1)
@@ -181,6 +228,50 @@ static void parse_arguments(int argc, char *argv[], Config &state)
       state.interval = atoi(optarg);
       printf("Interval:%d\n", atoi(optarg));
       break;
+    case 'R':
+      state.recover = true;
+      printf("recover\n");
+      break;
+    case 'L':
+      state.bulk_load = atof(optarg);
+      printf("bulk_load:%.2f\n", atof(optarg));
+      break;
+    case 'B':
+      state.batch = atoi(optarg);
+      printf("batch:%d\n", atoi(optarg));
+      break;
+    case 'H':
+      state.htm_retries = atoi(optarg);
+      printf("htm_retries:%d\n", atoi(optarg));
+      break;
+    case 'W':
+      state.htm_backoff = atoi(optarg);
+      printf("htm_backoff:%d\n", atoi(optarg));
+      break;
+    case 'C':
+      state.leaf_cache = atoi(optarg);
+      printf("leaf_cache:%d\n", atoi(optarg));
+      break;
+    case 'P':
+      state.pm_domain = atoi(optarg);
+      printf("pm_domain:%d\n", atoi(optarg));
+      break;
+    case 'X':
+      state.xpline_stripe = true;
+      printf("xpline_stripe\n");
+      break;
+    case 'M':
+      state.media_model = true;
+      printf("media_model\n");
+      break;
+    case 'c':
+      state.compact_ratio = atof(optarg);
+      printf("compact_ratio:%.2f\n", atof(optarg));
+      break;
+    case 'm':
+      state.merge_ratio = atof(optarg);
+      printf("merge_ratio:%.2f\n", atof(optarg));
+      break;
     case 'h':
       usage_exit(stdout);
       break;
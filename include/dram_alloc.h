@@ -0,0 +1,157 @@
+#ifndef dram_alloc_h
+#define dram_alloc_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <vector>
+
+/*
+ * DRAM arena for the leaf and inner nodes.
+ * One MAP_NORESERVE mapping is reserved up front and backed by 2 MB huge pages,
+ * transparent ones by default, explicit ones (hugetlbfs) with -DDRAM_HUGETLB.
+ * Explicit pages are reserved for the whole arena when it is mapped, if there
+ * are not enough of them the arena takes transparent ones.
+ * Threads take 2 MB chunks from it and bump inside their own chunk, so nodes
+ * built by a thread share huge pages. Pages are committed by the first touch;
+ * fresh memory is zero and is not cleared again.
+ */
+
+#define DRAM_HUGE_PAGE (2ULL << 20)
+#define DRAM_CHUNK_SIZE DRAM_HUGE_PAGE
+#define DRAM_ALIGN 64
+
+static __thread char *dram_tls_cur = NULL;
+static __thread char *dram_tls_end = NULL;
+
+class dram_arena_t
+{
+private:
+  char *base = NULL;
+  uint64_t size = 0;
+  uint64_t used = 0; // bytes handed out to chunks
+
+  // bytes from the global cursor, in whole chunks
+  char *take(uint64_t bytes)
+  {
+    bytes = (bytes + DRAM_CHUNK_SIZE - 1) / DRAM_CHUNK_SIZE * DRAM_CHUNK_SIZE;
+    uint64_t off = __sync_fetch_and_add(&used, bytes);
+    if (off + bytes > size)
+    {
+      printf("[DRAM]\tout of arena space, %lu MB in use\n", off >> 20);
+      exit(-1);
+    }
+    return base + off;
+  }
+
+public:
+  void init(uint64_t bytes)
+  {
+    size = (bytes + DRAM_HUGE_PAGE - 1) / DRAM_HUGE_PAGE * DRAM_HUGE_PAGE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    void *addr = MAP_FAILED;
+#ifdef DRAM_HUGETLB
+    // without MAP_NORESERVE a shortage fails here instead of raising SIGBUS at the first touch
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, (flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+    if (addr == MAP_FAILED)
+      printf("[DRAM]\tfewer than %lu explicit huge pages free, falling back to transparent ones\n", size / DRAM_HUGE_PAGE);
+#endif
+    if (addr == MAP_FAILED)
+    {
+      // over-reserve so that the arena starts on a huge page boundary
+      addr = mmap(NULL, size + DRAM_HUGE_PAGE, PROT_READ | PROT_WRITE, flags, -1, 0);
+      if (addr == MAP_FAILED)
+      {
+        printf("[DRAM]\tfailed to reserve %lu MB\n", size >> 20);
+        exit(-1);
+      }
+      addr = (void *)(((uint64_t)addr + DRAM_HUGE_PAGE - 1) & ~(DRAM_HUGE_PAGE - 1));
+      madvise(addr, size, MADV_HUGEPAGE);
+    }
+    base = (char *)addr;
+    used = 0;
+    dram_tls_cur = dram_tls_end = NULL;
+  }
+
+  // zeroed, DRAM_ALIGN aligned memory
+  void *alloc(size_t bytes)
+  {
+    bytes = (bytes + DRAM_ALIGN - 1) & ~(uint64_t)(DRAM_ALIGN - 1);
+    if (bytes > DRAM_CHUNK_SIZE / 4)
+      return take(bytes);
+    if (dram_tls_cur == NULL || dram_tls_cur + bytes > dram_tls_end)
+    {
+      dram_tls_cur = take(DRAM_CHUNK_SIZE);
+      dram_tls_end = dram_tls_cur + DRAM_CHUNK_SIZE;
+    }
+    void *ret = dram_tls_cur;
+    dram_tls_cur += bytes;
+    return ret;
+  }
+
+  // 32-bit handle of a DRAM_ALIGN aligned block of the arena, 0 is NULL
+  uint32_t handle(const void *p)
+  {
+    return p == NULL ? 0 : (uint32_t)(((const char *)p - base) / DRAM_ALIGN + 1);
+  }
+
+  char *from_handle(uint32_t h)
+  {
+    return h == 0 ? NULL : base + (uint64_t)(h - 1) * DRAM_ALIGN;
+  }
+
+  // every block of the arena has a handle
+  bool short_handles()
+  {
+    return size / DRAM_ALIGN < UINT32_MAX;
+  }
+
+  // position of the global cursor, rewind(mark()) gives back everything allocated in between
+  uint64_t mark()
+  {
+    return used;
+  }
+
+  // no thread may use the memory after m anymore, nor allocate while this runs; the memory is
+  // returned to the kernel, so it reads as zero again when it is handed out
+  void rewind(uint64_t m)
+  {
+    if (m < used && madvise(base + m, used - m, MADV_DONTNEED) != 0)
+      memset(base + m, 0, used - m);
+    used = m;
+    dram_tls_cur = dram_tls_end = NULL;
+  }
+
+  // bytes of the chunks handed out so far, cheap unlike committed()
+  uint64_t handed_out()
+  {
+    return used;
+  }
+
+  // resident bytes of the chunks handed out so far
+  uint64_t committed()
+  {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t len = used;
+    std::vector<unsigned char> vec((len + page - 1) / page);
+    if (len == 0 || mincore(base, len, vec.data()) != 0)
+      return 0;
+    uint64_t pages = 0;
+    for (size_t i = 0; i < vec.size(); i++)
+      pages += vec[i] & 1;
+    return pages * page;
+  }
+
+  void report(const char *when)
+  {
+    printf("[DRAM]\t%s: reserved %lu MB, handed out %lu MB, committed %lu MB\n", when,
+           size >> 20, used >> 20, committed() >> 20);
+  }
+};
+
+dram_arena_t dram_arena;
+
+#endif
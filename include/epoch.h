@@ -0,0 +1,173 @@
+#ifndef epoch_h
+#define epoch_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "thread_slot.h"
+
+/*
+ * Epoch-based reclamation.
+ * Every tree operation runs inside an epoch (epoch_guard). A node that has been
+ * unlinked is retired with the epoch it was unlinked in and freed once the
+ * global epoch is two ahead, i.e. every thread that could still hold a pointer
+ * to it has left its operation. A thread that exits leaves its retired nodes
+ * to the others.
+ */
+
+#define EPOCH_INACTIVE (~0llu)
+#define EPOCH_COLLECT_BATCH 64 // retired nodes a thread gathers before it tries to free them
+
+typedef void (*epoch_free_t)(void *);
+
+class epoch_manager_t
+{
+private:
+  struct retired_t
+  {
+    void *ptr;
+    epoch_free_t free;
+    uint64_t epoch;
+  };
+
+  struct alignas(64) slot_t
+  {
+    volatile uint64_t epoch; // epoch the owner entered, EPOCH_INACTIVE outside of operations
+    uint32_t depth;
+    std::vector<retired_t> limbo;
+  };
+
+  alignas(64) volatile uint64_t global_epoch = 0;
+  uint64_t retired = 0;
+  uint64_t freed = 0;
+  per_thread_t<slot_t> slots;
+  std::vector<retired_t> orphans; // limbo of the threads that have exited
+  volatile int orphans_lock = 0;
+
+  slot_t *my_slot()
+  {
+    return slots.mine();
+  }
+
+  // move the global epoch on if every active thread has seen it
+  void try_advance()
+  {
+    uint64_t e = global_epoch;
+    uint32_t num_slots = slots.size();
+    for (uint32_t i = 0; i < num_slots; i++)
+    {
+      uint64_t s = slots[i].epoch;
+      if (s != EPOCH_INACTIVE && s != e)
+        return;
+    }
+    __sync_bool_compare_and_swap(&global_epoch, e, e + 1);
+  }
+
+  // free the nodes of limbo whose grace period is over
+  void collect(std::vector<retired_t> &limbo)
+  {
+    uint64_t e = global_epoch;
+    size_t kept = 0;
+    for (size_t i = 0; i < limbo.size(); i++)
+    {
+      if (limbo[i].epoch + 2 <= e)
+      {
+        limbo[i].free(limbo[i].ptr);
+        __sync_fetch_and_add(&freed, 1);
+      }
+      else
+        limbo[kept++] = limbo[i];
+    }
+    limbo.resize(kept);
+  }
+
+  void collect(slot_t *s)
+  {
+    try_advance();
+    collect(s->limbo);
+    if (!orphans.empty() && !__sync_lock_test_and_set(&orphans_lock, 1))
+    {
+      collect(orphans);
+      __sync_lock_release(&orphans_lock);
+    }
+  }
+
+  // exit hook, the retired nodes of the slot wait in the orphans for the next collect
+  static void release(void *arg, uint32_t slot)
+  {
+    epoch_manager_t *mgr = (epoch_manager_t *)arg;
+    slot_t *s = &mgr->slots[slot];
+    s->depth = 0;
+    __atomic_store_n(&s->epoch, EPOCH_INACTIVE, __ATOMIC_RELEASE);
+    if (s->limbo.empty())
+      return;
+    while (__sync_lock_test_and_set(&mgr->orphans_lock, 1))
+      ;
+    mgr->orphans.insert(mgr->orphans.end(), s->limbo.begin(), s->limbo.end());
+    __sync_lock_release(&mgr->orphans_lock);
+    s->limbo.clear();
+  }
+
+public:
+  epoch_manager_t()
+  {
+    for (int i = 0; i < MAX_THREADS; i++)
+    {
+      slots[i].epoch = EPOCH_INACTIVE;
+      slots[i].depth = 0;
+    }
+    thread_slots.at_exit(release, this);
+  }
+
+  void enter()
+  {
+    slot_t *s = my_slot();
+    if (s->depth++ == 0)
+    {
+      s->epoch = global_epoch;
+      __sync_synchronize();
+    }
+  }
+
+  void exit()
+  {
+    slot_t *s = my_slot();
+    if (--s->depth == 0)
+      __atomic_store_n(&s->epoch, EPOCH_INACTIVE, __ATOMIC_RELEASE);
+  }
+
+  // epoch the calling thread entered its running operation in
+  uint64_t entered()
+  {
+    return my_slot()->epoch;
+  }
+
+  // ptr is unreachable for new operations, call free(ptr) after the grace period
+  void retire(void *ptr, epoch_free_t free)
+  {
+    slot_t *s = my_slot();
+    retired_t r = {ptr, free, global_epoch};
+    s->limbo.push_back(r);
+    __sync_fetch_and_add(&retired, 1);
+    if (s->limbo.size() >= EPOCH_COLLECT_BATCH)
+      collect(s);
+  }
+
+  void report()
+  {
+    printf("[EPOCH]\tepoch %lu, retired %lu nodes, freed %lu\n", global_epoch, retired, freed);
+  }
+};
+
+epoch_manager_t epoch_mgr;
+
+// scoped epoch of one tree operation
+class epoch_guard
+{
+public:
+  epoch_guard() { epoch_mgr.enter(); }
+  ~epoch_guard() { epoch_mgr.exit(); }
+};
+
+#endif
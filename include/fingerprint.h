@@ -0,0 +1,130 @@
+#ifndef fingerprint_h
+#define fingerprint_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <immintrin.h>
+
+/*
+ * Fingerprint hash policies, map a key to the 1-byte fingerprint of its slot.
+ * The tree uses FP_HASH, choose another one with -DFP_HASH=<policy>.
+ */
+// take the high byte of a single Fibonacci multiply, spreads clustered integer keys
+class MulShiftHash
+{
+public:
+  static const char *name() { return "mulshift"; }
+  static inline uint8_t hash(uint64_t key)
+  {
+    return (uint8_t)((key * 0x9E3779B97F4A7C15llu) >> 56);
+  }
+};
+
+// one crc32 instruction (SSE4.2), folded down to a byte
+class CRC32CHash
+{
+public:
+  static const char *name() { return "crc32c"; }
+  __attribute__((target("sse4.2"))) static inline uint8_t hash(uint64_t key)
+  {
+    uint32_t crc = (uint32_t)_mm_crc32_u64(0, key);
+    crc ^= crc >> 16;
+    return (uint8_t)(crc ^ (crc >> 8));
+  }
+};
+
+// byte-wise FNV-1a, the original hash of NBTree
+class FNVHash
+{
+public:
+  static const char *name() { return "fnv"; }
+  static inline uint8_t hash(uint64_t key)
+  {
+    static const uint64_t kFNVPrime64 = 1099511628211;
+    unsigned char hash = 123;
+    for (int i = 0; i < sizeof(uint64_t); i++)
+    {
+      uint64_t octet = key & 0x00ff;
+      key = key >> 8;
+
+      hash = hash ^ octet;
+      hash = hash * kFNVPrime64;
+    }
+    return hash;
+  }
+};
+
+#ifndef FP_HASH
+#define FP_HASH MulShiftHash
+#endif
+typedef FP_HASH fp_hash_t;
+
+/*
+ * Fingerprint probe of a leaf node.
+ * Compare every fingerprint of a leaf against the hash of the search key and
+ * return a bitmask with bit i set iff finger_prints[i] == hash. The caller ANDs
+ * the mask with the leaf bitmap and only reads the PM keys of the matches.
+ *
+ * The vector versions always load a whole 32/64-byte window, so the fingerprint
+ * array must be 64-byte aligned and the node must be at least 64 bytes long.
+ * n is the number of allocated slots; lanes beyond n are garbage and have to be
+ * masked off by the caller.
+ */
+typedef uint64_t (*fp_probe_t)(const uint8_t *fps, uint8_t hash, int n);
+
+static uint64_t fp_probe_scalar(const uint8_t *fps, uint8_t hash, int n)
+{
+  uint64_t mask = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    if (fps[i] == hash)
+      mask |= (1llu << i);
+  }
+  return mask;
+}
+
+__attribute__((target("avx2"))) static uint64_t fp_probe_avx2(const uint8_t *fps, uint8_t hash, int n)
+{
+  __m256i h = _mm256_set1_epi8((char)hash);
+  __m256i lo = _mm256_load_si256((const __m256i *)fps);
+  uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, h));
+  if (n > 32)
+  {
+    __m256i hi = _mm256_load_si256((const __m256i *)(fps + 32));
+    mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, h)) << 32;
+  }
+  return mask;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static uint64_t fp_probe_avx512(const uint8_t *fps, uint8_t hash, int n)
+{
+  __m512i h = _mm512_set1_epi8((char)hash);
+  __m512i v = _mm512_load_si512((const void *)fps);
+  return _mm512_cmpeq_epi8_mask(v, h);
+}
+
+static fp_probe_t fp_probe_select()
+{
+  __builtin_cpu_init();
+  if (getenv("NBTREE_NO_SIMD"))
+    return fp_probe_scalar;
+  if (__builtin_cpu_supports("avx512bw"))
+    return fp_probe_avx512;
+  if (__builtin_cpu_supports("avx2"))
+    return fp_probe_avx2;
+  return fp_probe_scalar;
+}
+
+static const char *fp_probe_name(fp_probe_t probe)
+{
+  if (probe == fp_probe_avx512)
+    return "avx512";
+  if (probe == fp_probe_avx2)
+    return "avx2";
+  return "scalar";
+}
+
+// chosen once by CPUID when the program starts
+static const fp_probe_t fp_probe = fp_probe_select();
+
+#endif
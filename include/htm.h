@@ -0,0 +1,172 @@
+#ifndef htm_h
+#define htm_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "thread_slot.h"
+
+/*
+ * RTM lock elision with statistics.
+ * A critical section first runs as a hardware transaction that only reads the
+ * lock word; it is retried up to htm_retries times with an exponential pause
+ * backoff and then falls back to taking the lock. Capacity aborts and other
+ * aborts the hardware does not mark as retryable go to the lock at once. Every
+ * thread counts its transactions, commits, aborts by cause and fallbacks;
+ * htm_report() sums them up. Hosts without RTM (CPUID, or NBTREE_NO_HTM=1)
+ * always take the lock.
+ */
+
+#define HTM_LOCK_BUSY 0xff // explicit abort code: the elided lock was held
+#define HTM_MAX_BACKOFF 4096
+
+int htm_retries = 8;  // transaction attempts after the first one
+int htm_backoff = 16; // pause iterations before the first retry, doubled for every further one
+
+struct alignas(64) htm_stats_t
+{
+  uint64_t starts;
+  uint64_t commits;
+  uint64_t conflict;
+  uint64_t capacity;
+  uint64_t explicit_abort;
+  uint64_t other;
+  uint64_t fallbacks;
+};
+
+static per_thread_t<htm_stats_t> htm_stats;
+
+static bool htm_detect()
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (getenv("NBTREE_NO_HTM"))
+    return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ebx & bit_RTM) != 0;
+}
+
+// chosen once by CPUID when the program starts
+static const bool htm_enabled = htm_detect();
+
+static inline htm_stats_t *htm_my_stats()
+{
+  return htm_stats.mine();
+}
+
+// start a transaction that elides the lock held while *word & busy is set,
+// true inside the transaction, false when the caller has to take the lock
+__attribute__((target("rtm"))) static bool htm_try_elide(volatile uint32_t *word, uint32_t busy)
+{
+  htm_stats_t *st = htm_my_stats();
+  if (!htm_enabled)
+  {
+    st->fallbacks++;
+    return false;
+  }
+  for (int attempt = 0; attempt <= htm_retries; attempt++)
+  {
+    st->starts++;
+    unsigned status = _xbegin();
+    if (status == _XBEGIN_STARTED)
+    {
+      // the lock word joins the read set, a thread that takes the lock aborts us
+      if (*word & busy)
+        _xabort(HTM_LOCK_BUSY);
+      return true;
+    }
+    if (status & _XABORT_CAPACITY)
+    {
+      // the same section will not fit on a retry either
+      st->capacity++;
+      break;
+    }
+    if (status & _XABORT_EXPLICIT)
+    {
+      st->explicit_abort++;
+      // wait for the holder instead of aborting on it again
+      if (_XABORT_CODE(status) == HTM_LOCK_BUSY)
+        while (*word & busy)
+          asm("pause");
+    }
+    else if (status & _XABORT_CONFLICT)
+      st->conflict++;
+    else
+    {
+      st->other++;
+      if (!(status & _XABORT_RETRY))
+        break;
+    }
+    int backoff = htm_backoff << attempt;
+    if (backoff > HTM_MAX_BACKOFF || backoff <= 0)
+      backoff = HTM_MAX_BACKOFF;
+    for (int i = 0; i < backoff; i++)
+      asm("pause");
+  }
+  st->fallbacks++;
+  return false;
+}
+
+// end the transaction htm_try_elide started
+__attribute__((target("rtm"))) static inline void htm_commit()
+{
+  _xend();
+  htm_my_stats()->commits++;
+}
+
+class htm_mutex_t
+{
+public:
+  volatile uint32_t word = 0;
+};
+
+// scoped section of a htm_mutex_t, elided when possible
+class htm_lock_t
+{
+private:
+  htm_mutex_t *m = NULL;
+  bool elided = false;
+
+public:
+  void acquire(htm_mutex_t &mutex)
+  {
+    m = &mutex;
+    elided = htm_try_elide(&m->word, 1);
+    if (elided)
+      return;
+    while (!__sync_bool_compare_and_swap(&m->word, 0, 1))
+      asm("pause");
+  }
+
+  void release()
+  {
+    if (elided)
+      htm_commit();
+    else
+      __atomic_store_n(&m->word, 0, __ATOMIC_RELEASE);
+    m = NULL;
+  }
+};
+
+static inline void htm_report()
+{
+  htm_stats_t sum = {};
+  for (uint32_t i = 0; i < htm_stats.size(); i++)
+  {
+    sum.starts += htm_stats[i].starts;
+    sum.commits += htm_stats[i].commits;
+    sum.conflict += htm_stats[i].conflict;
+    sum.capacity += htm_stats[i].capacity;
+    sum.explicit_abort += htm_stats[i].explicit_abort;
+    sum.other += htm_stats[i].other;
+    sum.fallbacks += htm_stats[i].fallbacks;
+  }
+  printf("[HTM]\t%s, retries %d, backoff %d\n", htm_enabled ? "rtm" : "no rtm, locks only", htm_retries, htm_backoff);
+  printf("[HTM]\ttransactions %lu, commits %lu, aborts: conflict %lu, capacity %lu, explicit %lu, other %lu, fallbacks %lu\n",
+         sum.starts, sum.commits, sum.conflict, sum.capacity, sum.explicit_abort, sum.other, sum.fallbacks);
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef inner_search_h
+#define inner_search_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <immintrin.h>
+
+/*
+ * Separator search of an inner node, the forward (no shift in progress) case.
+ * records are the 16-byte (key, ptr) pairs of the node. Return the first index
+ * i in [1, n) with ptr == NULL or key < records[i].key, n if there is none.
+ *
+ * The probe reads every record once and does not look for FAST&FAIR shifts;
+ * the caller re-reads the key it stopped at and falls back to the scalar loop
+ * if it changed. The vector versions read whole groups of 4/8 records but never
+ * beyond records[n - 1].
+ *
+ * The compact versions search 8-byte records, the low half of a record is the
+ * key suffix and the high half the child handle; key is the suffix of the
+ * searched key.
+ */
+typedef int (*inner_probe_t)(const uint64_t *records, uint64_t key, int n);
+
+static int inner_probe_scalar(const uint64_t *records, uint64_t key, int n)
+{
+  int i;
+  for (i = 1; i < n; ++i)
+  {
+    if (records[2 * i + 1] == 0 || key < records[2 * i])
+      break;
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static int inner_probe_avx2(const uint64_t *records, uint64_t key, int n)
+{
+  // AVX2 compares signed, flip the sign bits to compare unsigned keys
+  const __m256i sign = _mm256_set1_epi64x((long long)(1llu << 63));
+  const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), sign);
+  const __m256i zero = _mm256_setzero_si256();
+  int i = 1;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(records + 2 * i));     // records i, i + 1
+    __m256i b = _mm256_loadu_si256((const __m256i *)(records + 2 * i + 4)); // records i + 2, i + 3
+    // lanes hold the records i, i + 2, i + 1, i + 3
+    __m256i keys = _mm256_xor_si256(_mm256_unpacklo_epi64(a, b), sign);
+    __m256i ptrs = _mm256_unpackhi_epi64(a, b);
+    __m256i stop = _mm256_or_si256(_mm256_cmpgt_epi64(keys, k), _mm256_cmpeq_epi64(ptrs, zero));
+    int m = _mm256_movemask_pd(_mm256_castsi256_pd(stop));
+    if (m)
+    {
+      m = (m & 9) | ((m & 2) << 1) | ((m & 4) >> 1);
+      return i + __builtin_ctz(m);
+    }
+  }
+  for (; i < n; ++i)
+  {
+    if (records[2 * i + 1] == 0 || key < records[2 * i])
+      break;
+  }
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int inner_probe_avx512(const uint64_t *records, uint64_t key, int n)
+{
+  const __m512i key_idx = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+  const __m512i ptr_idx = _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1);
+  const __m512i k = _mm512_set1_epi64((long long)key);
+  int i = 1;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m512i a = _mm512_loadu_si512((const void *)(records + 2 * i));
+    __m512i b = _mm512_loadu_si512((const void *)(records + 2 * i + 8));
+    __m512i keys = _mm512_permutex2var_epi64(a, key_idx, b);
+    __m512i ptrs = _mm512_permutex2var_epi64(a, ptr_idx, b);
+    __mmask8 m = _mm512_cmpgt_epu64_mask(keys, k) | _mm512_cmpeq_epi64_mask(ptrs, _mm512_setzero_si512());
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  for (; i < n; ++i)
+  {
+    if (records[2 * i + 1] == 0 || key < records[2 * i])
+      break;
+  }
+  return i;
+}
+
+static int inner_probe_compact_scalar(const uint64_t *records, uint64_t key, int n)
+{
+  int i;
+  for (i = 1; i < n; ++i)
+  {
+    if ((records[i] >> 32) == 0 || key < (uint32_t)records[i])
+      break;
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static int inner_probe_compact_avx2(const uint64_t *records, uint64_t key, int n)
+{
+  // the suffixes are below 2^32, the signed compare is enough
+  const __m256i suffix = _mm256_set1_epi64x(0xffffffffll);
+  const __m256i k = _mm256_set1_epi64x((long long)key);
+  const __m256i zero = _mm256_setzero_si256();
+  int i = 1;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m256i r = _mm256_loadu_si256((const __m256i *)(records + i));
+    __m256i stop = _mm256_or_si256(_mm256_cmpgt_epi64(_mm256_and_si256(r, suffix), k),
+                                   _mm256_cmpeq_epi64(_mm256_srli_epi64(r, 32), zero));
+    int m = _mm256_movemask_pd(_mm256_castsi256_pd(stop));
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  for (; i < n; ++i)
+  {
+    if ((records[i] >> 32) == 0 || key < (uint32_t)records[i])
+      break;
+  }
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int inner_probe_compact_avx512(const uint64_t *records, uint64_t key, int n)
+{
+  const __m512i suffix = _mm512_set1_epi64(0xffffffffll);
+  const __m512i no_child = _mm512_set1_epi64(1ll << 32);
+  const __m512i k = _mm512_set1_epi64((long long)key);
+  int i = 1;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m512i r = _mm512_loadu_si512((const void *)(records + i));
+    __mmask8 m = _mm512_cmpgt_epu64_mask(_mm512_and_si512(r, suffix), k) | _mm512_cmplt_epu64_mask(r, no_child);
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  for (; i < n; ++i)
+  {
+    if ((records[i] >> 32) == 0 || key < (uint32_t)records[i])
+      break;
+  }
+  return i;
+}
+
+static inner_probe_t inner_probe_select()
+{
+  __builtin_cpu_init();
+  if (getenv("NBTREE_NO_SIMD"))
+    return inner_probe_scalar;
+  if (__builtin_cpu_supports("avx512f"))
+    return inner_probe_avx512;
+  if (__builtin_cpu_supports("avx2"))
+    return inner_probe_avx2;
+  return inner_probe_scalar;
+}
+
+static const char *inner_probe_name(inner_probe_t probe)
+{
+  if (probe == inner_probe_avx512)
+    return "avx512";
+  if (probe == inner_probe_avx2)
+    return "avx2";
+  return "scalar";
+}
+
+// the compact probe of the same instruction set
+static inner_probe_t inner_probe_compact_for(inner_probe_t probe)
+{
+  if (probe == inner_probe_avx512)
+    return inner_probe_compact_avx512;
+  if (probe == inner_probe_avx2)
+    return inner_probe_compact_avx2;
+  return inner_probe_compact_scalar;
+}
+
+// chosen once by CPUID when the program starts, node_bench switches them to compare
+static inner_probe_t inner_probe = inner_probe_select();
+static inner_probe_t inner_probe_compact = inner_probe_compact_for(inner_probe);
+
+#endif
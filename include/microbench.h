@@ -13,6 +13,8 @@ enum OperationType
 	REMOVE,
 	UPDATE,
 	GET,
+	SCAN,
+	SCAN_REVERSE,
 	_OpreationTypeNumber
 };
 
@@ -56,6 +58,10 @@ public:
 		{
 			workload = new ZipfWrapper(conf.skewness, conf.init_keys);
 		}
+		else if (conf.workload == SEQUENTIAL)
+		{
+			workload = new MonotonicGenerator();
+		}
 
 		x = NULL;
 	}
@@ -96,6 +102,33 @@ public:
 	}
 };
 
+class ScanBench : public Benchmark
+{
+public:
+	ScanBench(Config &conf) : Benchmark(conf)
+	{
+	}
+	// the scan length is conf.scan_length
+	std::pair<OperationType, long long> nextOperation()
+	{
+		long long d = workload->Next();
+		return std::make_pair(SCAN, d % _conf.init_keys + 1);
+	}
+};
+
+class ScanReverseBench : public Benchmark
+{
+public:
+	ScanReverseBench(Config &conf) : Benchmark(conf)
+	{
+	}
+	std::pair<OperationType, long long> nextOperation()
+	{
+		long long d = workload->Next();
+		return std::make_pair(SCAN_REVERSE, d % _conf.init_keys + 1);
+	}
+};
+
 class InsertOnlyBench : public Benchmark
 {
 	RandomGenerator *salt;
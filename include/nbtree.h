@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <fstream>
@@ -13,57 +14,145 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <thread>
 #include <time.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-#include <tbb/spin_rw_mutex.h>
 #include "util.h"
 #include "timer.h"
-#define eADR
+#include "fingerprint.h"
+#include "inner_search.h"
+#include "htm.h"
 #define NVM
 #define CACHE_LINE 64
 #define PAGESIZE 512
-#define LEAF_NODE_SIZE 31
+#ifndef LEAF_NODE_SIZE
+#define LEAF_NODE_SIZE 31 // slots per leaf, at most 63; 63 gives 1 KB data nodes
+#endif
+#define MULTI_SEARCH_GROUP 16 // lookups of multi_search that are interleaved
+#define LEAF_CACHE_MAX 16     // leaves a thread can remember
 #define IS_FORWARD(c) (c % 2 == 0)
+#define VERSION_LOCKED 1u   // version lock of an inner node: a writer holds the node
+#define VERSION_OBSOLETE 2u // the node has been unlinked
+#define VERSION_STEP 4u     // every unlock counts one write
 #define FULL ((1llu << LEAF_NODE_SIZE) - 1)
+#define FROZEN (1llu << 63)
 #define SYNC_MASK 1llu << 63
 #define COPY_MASK 1llu << 62
 #define MASK (SYNC_MASK | COPY_MASK)
+#define LOG_SYNCED 1llu // tag in data_node_t::log, the split has been synced into the new nodes
+#define XPLINE_SLOTS (XPLINE_SIZE / 16)                                    // entries in one XPLine of a data node
+#define LEAF_STRIPES ((LEAF_NODE_SIZE + XPLINE_SLOTS - 1) / XPLINE_SLOTS) // XPLines the entries of a data node take
+#define POOL_MAGIC 0x4e42545245453031llu
+#define POOL_VERSION 4
+#define SKIP_SLOTS 512 // skip pointers into the data node chain, one 4 KB block
+#define SKIP_EVERY 64  // splits per new skip pointer, and the least number of nodes between two
+#define MERGE_RETRY_REMOVES 8 // removes from a leaf whose merge failed before it tries again
+
+#include "pm_alloc.h"
+#include "epoch.h"
+#include "dram_alloc.h"
 
 using entry_key_t = uint64_t;
 
+static_assert(LEAF_NODE_SIZE > 0 && LEAF_NODE_SIZE <= 63, "the leaf bitmap holds at most 63 slots");
+
 pthread_mutex_t print_mtx;
 
 const uint64_t SPACE_PER_THREAD = 512ULL * 1024ULL * 1024ULL;
 const uint64_t SPACE_OF_MAIN_THREAD = 1ULL * 1024ULL * 1024ULL * 1024ULL;
-extern __thread char *start_addr;
-extern __thread char *curr_addr;
 
 const uint64_t MEM_PER_THREAD = 1ULL * 1024ULL * 1024ULL * 1024ULL;
 const uint64_t MEM_OF_MAIN_THREAD = 1ULL * 1024ULL * 1024ULL * 1024ULL;
-extern __thread char *start_mem;
-extern __thread char *curr_mem;
 
-typedef tbb::speculative_spin_rw_mutex speculative_lock_t;
-typedef speculative_lock_t::scoped_lock htm_lock;
+typedef htm_mutex_t speculative_lock_t;
+typedef htm_lock_t htm_lock;
 using namespace std;
 
-void *data_alloc(size_t size)
+// nodes and keys the calling thread added and removed, btree::memory_stats() sums the slots;
+// nodes are often freed by another thread than the one that allocated them, so a single slot
+// may wrap below zero while the sums do not
+struct alignas(64) mem_stats_t
+{
+  uint64_t leaves, data_nodes, inner_nodes;             // allocated
+  uint64_t retired_leaves, retired_data, retired_inner; // handed to the epoch manager
+  uint64_t freed_leaves, freed_data, freed_inner;       // ... and given back after the grace period
+  uint64_t keys;                                        // inserted minus removed
+};
+
+static per_thread_t<mem_stats_t> mem_stats;
+
+static mem_stats_t *my_mem_stats()
+{
+  return mem_stats.mine();
+}
+
+// a tree that is thrown away takes its nodes back out of the counters: save them before it is
+// built and restore them after, while no other thread counts
+static per_thread_t<mem_stats_t> mem_stats_saved;
+
+static inline void mem_stats_save()
+{
+  mem_stats_saved = mem_stats;
+}
+
+static inline void mem_stats_restore()
+{
+  mem_stats = mem_stats_saved;
+}
+
+// every data node comes from here, the superblock is taken from pm_heap directly
+void *data_alloc(size_t size, bool zero = true)
 {
-  void *ret = curr_addr;
-  curr_addr += size;
+  my_mem_stats()->data_nodes++;
+  return pm_heap.alloc(size, zero);
+}
 
-  return ret;
+// the separator in (left, right] with the most trailing zero bits: right with the bits
+// below the highest one it differs from left in cleared
+static inline entry_key_t short_separator(entry_key_t left, entry_key_t right)
+{
+  if (left >= right)
+    return right;
+  int bit = 63 - __builtin_clzll(left ^ right);
+  return right & ~((1llu << bit) - 1);
 }
 
+// leaves freed by the epoch manager, the pointer keeps an ABA tag in its upper 16 bits
+uint64_t leaf_free_list = 0;
+#define LEAF_PTR_MASK ((1llu << 48) - 1)
+
+// all leaves have the same size, a freed one is reused first
 void *leaf_alloc(size_t size)
 {
-  void *ret = curr_mem;
-  memset(ret, 0, size);
-  curr_mem += size;
+  uint64_t head, next;
+  my_mem_stats()->leaves++;
+  while (((head = leaf_free_list) & LEAF_PTR_MASK) != 0)
+  {
+    char *ret = (char *)(head & LEAF_PTR_MASK);
+    next = *(uint64_t *)ret | ((head + (1llu << 48)) & ~LEAF_PTR_MASK);
+    if (__sync_bool_compare_and_swap(&leaf_free_list, head, next))
+    {
+      memset(ret, 0, size);
+      return ret;
+    }
+  }
 
-  return ret;
+  return dram_arena.alloc(size);
+}
+
+void leaf_free(void *leaf)
+{
+  uint64_t head, next;
+  do
+  {
+    head = leaf_free_list;
+    *(uint64_t *)leaf = head & LEAF_PTR_MASK;
+    next = (uint64_t)leaf | ((head + (1llu << 48)) & ~LEAF_PTR_MASK);
+  } while (!__sync_bool_compare_and_swap(&leaf_free_list, head, next));
 }
 
 class
@@ -71,47 +160,130 @@ class
 class leaf_node_t;
 class data_node_t;
 class inner_node_t;
+class scan_iterator;
+class scan_reverse_iterator;
+
+typedef std::pair<entry_key_t, char *> scan_entry_t;
+
+// root object of the pool, where recovery starts
+class pm_superblock_t
+{
+public:
+  uint64_t magic;
+  uint64_t version;
+  uint64_t clean;                  // set on a clean shutdown, cleared while the pool is open
+  pm_ptr<data_node_t> data_anchor; // head of the data node chain
+  pm_ptr<class pm_skip_table_t> skip;
+};
+
+// data nodes spread over the chain, recovery walks the chain from all of them in parallel.
+// A slot only points at a node that is in the chain or replaced by a synced split; the leaf of
+// the node knows its slot and moves the pointer to its successor before it is retired
+class pm_skip_table_t
+{
+public:
+  pm_ptr<data_node_t> node[SKIP_SLOTS];
+};
+
+// footprint of the nodes of every tree in the process, from counters kept on the way
+// instead of a walk; live nodes are reachable, retired ones wait for their grace period
+struct memory_stats_t
+{
+  uint64_t leaves, data_nodes, inner_nodes;
+  uint64_t retired_leaves, retired_data, retired_inner;
+  uint64_t keys;
+  uint64_t dram_bytes, pm_bytes;                 // live nodes
+  uint64_t dram_retired_bytes, pm_retired_bytes; // retired nodes
+  uint64_t dram_arena_bytes, pm_heap_bytes;      // chunks the allocators handed out, free blocks included
+  double leaf_fill;                              // keys per leaf slot
+  double dram_per_key, pm_per_key;               // bytes of the live and retired nodes per key
+};
 
 class btree
 {
 private:
   int height;
   char *root;
+  uint64_t skip_splits = 0;
 
 public:
-  data_node_t *data_anchor = NULL;
+  pm_superblock_t *meta = NULL;
   leaf_node_t *anchor = NULL;
   speculative_lock_t mtx;
   int c;
+  uint64_t recover_walk_ns = 0; // time the last recovery took to walk the chain
+  uint32_t recover_groups = 0;  // ... from this many starting points
   btree();
   ~btree();
+  static btree *recover(char *pool, int num_threads = 1);
+  template <class Iter>
+  bool bulk_load(Iter first, Iter last, float fill_factor = 0.7, int num_threads = 1);
+  void shutdown();
+  static memory_stats_t memory_stats();
+  int get_height() { return height; }
   void setNewRoot(char *new_root, leaf_node_t *leaf = NULL);
-  void btree_insert_internal(char *, entry_key_t, char *, uint32_t, leaf_node_t *leaf = NULL);
+  void btree_insert_internal(char *, entry_key_t, char *, uint32_t, leaf_node_t *leaf = NULL, inner_node_t *child = NULL);
   char *btree_search(entry_key_t);
   void print();
   void check();
   bool insert(entry_key_t, char *); 
+  int insert_batch(std::pair<entry_key_t, char *> *kvs, int n);
   bool remove(entry_key_t);
   bool update(entry_key_t, char *);
   char *search(entry_key_t);
+  void multi_search(entry_key_t *keys, int n, char **out);
+  int scan(entry_key_t start_key, int count, scan_entry_t *out);
+  int scan_reverse(entry_key_t start_key, int count, scan_entry_t *out);
 private:
-  static const uint64_t kFNVPrime64 = 1099511628211;
   unsigned char hashfunc(uint64_t val);
   int find_item(entry_key_t key, leaf_node_t *leaf, uint8_t hash);
+  char *search_leaf(leaf_node_t *leaf, entry_key_t key, uint8_t hash);
   bool modify(leaf_node_t *leaf, int pos, entry_key_t key, char *right);
   leaf_node_t *find_leaf(entry_key_t key, inner_node_t **parent, bool debug, bool print);
   leaf_node_t *find_pred_leaf(entry_key_t key, char **prev, inner_node_t **parent);
   leaf_node_t *inner_node_search(entry_key_t key, char **prev, inner_node_t **parent);
   leaf_node_t *inner_node_search(entry_key_t key, inner_node_t **parent, bool debug, bool print);
+  leaf_node_t *cached_leaf(entry_key_t key);
+  void cache_leaf(leaf_node_t *leaf);
+  leaf_node_t *find_cached_leaf(entry_key_t key);
   leaf_node_t *SplitLeaf(leaf_node_t *leaf, inner_node_t *parent, leaf_node_t *, entry_key_t, bool, int);
   // help function for split
-  void copy(leaf_node_t *leaf);
+  bool copy(leaf_node_t *leaf);
   void sync(leaf_node_t *leaf);
+  void sync_entry(leaf_node_t *leaf, uint64_t valid, data_node_t *node, int j);
   void update_prev_node(leaf_node_t *leaf, inner_node_t *parent, leaf_node_t *prev = NULL);
   void update_parent(leaf_node_t *leaf, inner_node_t *parent);
+  void replace_leaf(leaf_node_t *leaf, inner_node_t *parent);
   bool check_pred(entry_key_t key, char **prev, inner_node_t *parent, int id);
   bool check_parent(char *left, entry_key_t key, char *right, uint32_t level, inner_node_t *parent, leaf_node_t *leaf, int id);
-
+  // help function for merge
+  void merge_leaf(leaf_node_t *leaf, entry_key_t key);
+  bool merge_copy(leaf_node_t *left);
+  void merge_sync(leaf_node_t *left);
+  void link_merged(leaf_node_t *prev, leaf_node_t *left);
+  void merge_inner(inner_node_t *p);
+  // help function for the skip pointers
+  void skip_build(std::vector<page *> &leaves);
+  void skip_add(leaf_node_t *leaf);
+  void skip_move(leaf_node_t *leaf);
+  // help function for recovery
+  explicit btree(pm_superblock_t *sb);
+  bool recover_leaf(leaf_node_t *leaf, data_node_t *node, bool first);
+  void recover_walk(std::vector<data_node_t *> &nodes, int num_threads);
+  void recover_walk_groups(std::vector<data_node_t *> *starts, std::unordered_set<data_node_t *> *stops,
+                           std::vector<std::vector<data_node_t *>> *groups, std::vector<data_node_t *> *ends, size_t *next);
+  void recover_leaves(data_node_t **nodes, leaf_node_t *leaves, uint8_t *live, size_t begin, size_t end);
+  void build_inner_levels(std::vector<page *> &nodes, std::vector<entry_key_t> &low_keys, uint32_t level, float fill);
+  // help function for bulk load
+  void bulk_alloc_leaves(leaf_node_t *leaves, size_t begin, size_t end);
+  template <class Iter>
+  void bulk_fill_leaves(Iter first, size_t n, int per_leaf, leaf_node_t *leaves, size_t num_leaves, size_t begin, size_t end);
+  // help function for scan
+  void scan_leaf(leaf_node_t *leaf, entry_key_t low, entry_key_t high, std::vector<scan_entry_t> &buf);
+  leaf_node_t *find_leaf_from(entry_key_t key, inner_node_t **parent);
+
+  friend class scan_iterator;
+  friend class scan_reverse_iterator;
   friend class page;
   friend class inner_node_t;
   friend class leaf_node_t;
@@ -130,12 +302,11 @@ private:
   inner_node_t *pred_ptr;    // 8 bytes
   entry_key_t high_key;      // 8 bytes
   entry_key_t low_key;       // 8 bytes
-  // uint32_t level;            // 4 bytes
-  uint16_t level;         // 2 byte
-  uint8_t spin_lock;      // 1 byte
-  uint8_t switch_counter; // 1 bytes
-  uint8_t is_deleted;     // 1 bytes
-  int16_t last_index;     // 2 bytes
+  uint32_t version;          // 4 bytes, optimistic lock: VERSION_LOCKED, VERSION_OBSOLETE and a write count
+  uint8_t level;             // 1 byte
+  uint8_t switch_counter;    // 1 bytes
+  int8_t last_index;         // 1 byte
+  uint8_t compact;           // 1 byte, the records are entry32s, fixed when the node is created
   friend class page;
   friend class btree;
   friend class inner_node_t;
@@ -148,9 +319,10 @@ public:
     pred_ptr = NULL;
     high_key = ~(0llu);
     low_key = 0;
+    version = 0;
     switch_counter = 0;
     last_index = -1;
-    is_deleted = false;
+    compact = 0;
   }
 };
 
@@ -174,15 +346,30 @@ public:
   friend class data_node_t;
 };
 
+// record of a compact inner node, all keys of the node share their high 32 bits with hdr.low_key
+class entry32
+{
+private:
+  uint32_t key; // low 32 bits of the key
+  uint32_t ptr; // dram_arena handle of the child
+
+  friend class inner_node_t;
+};
+
 const int cardinality = (PAGESIZE - sizeof(header)) / sizeof(entry);
+const int cardinality_compact = (PAGESIZE - sizeof(header)) / sizeof(entry32);
+#define KEY_PREFIX(k) ((k) & ~0xffffffffllu)
+
+// inner nodes whose key range allows it use entry32 records, NBTREE_NO_COMPACT=1 keeps them all wide
+static bool inner_compact = getenv("NBTREE_NO_COMPACT") == NULL;
 const int count_in_line = CACHE_LINE_SIZE / sizeof(entry);
 
-class data_node_t : public page
+class alignas(CACHE_LINE) data_node_t : public page
 {
 public:
   entry kv[LEAF_NODE_SIZE]; // 16*leaf_node_size byte
-  data_node_t *next;        // 8 byte
-  data_node_t *log;         // 8 byte
+  pm_ptr<data_node_t> next; // 8 byte
+  pm_ptr<data_node_t> log;  // 8 byte
 
   data_node_t()
   {
@@ -220,10 +407,20 @@ public:
     }
   }
 
+  data_node_t *log_node()
+  {
+    return pm_ptr<data_node_t>::to_ptr(log.raw() & ~LOG_SYNCED);
+  }
+
+  bool log_synced()
+  {
+    return (log.raw() & LOG_SYNCED) != 0;
+  }
+
   inline void _prefetch()
   {
     char *start_ptr = (char *)this;
-    int length = PAGESIZE / 64;
+    int length = sizeof(data_node_t) / 64;
     while (length-- > 0)
     {
       prefetch(start_ptr);
@@ -236,26 +433,45 @@ class leaf_node_t : public page
 {
 public:
   alignas(64) uint8_t finger_prints[LEAF_NODE_SIZE];
-  uint32_t bitmap;
+  uint64_t bitmap; // committed slots
+  uint64_t frozen; // snapshot of bitmap taken when the split begins, valid once FROZEN is set
+  uint32_t split;  // split flag, kept out of bitmap so a leaf can use all 63 bits
   uint32_t number;
+  uint32_t copied;  // entries the split copied into this leaf, sync only touches these
+  uint64_t claimed; // slots handed out, only kept up to date with xpline_stripe
   entry_key_t high_key;
   entry_key_t low_key;
   data_node_t *data;
   leaf_node_t *next;
   leaf_node_t *log;
+  leaf_node_t *sibling; // the second new leaf of the same split, next may move on; NULL after a compaction
   bool copy_flag;
   bool sync_flag;
   bool prev_flag;
   bool fin_flag;
+  bool retired; // handed to the epoch manager by the split that replaced it
+  uint32_t skip; // 1 + the skip table slot that points at data, 0 if none
+  uint32_t merge_retry;    // value of deleted from which removes try to merge this leaf, moved on by a failed merge
+  uint32_t deleted;        // removes that hit this leaf, about popcount(bitmap) - deleted entries are live
+  leaf_node_t *merge_next; // the right leaf of the merge this leaf is the left one of, set before frozen is published
+  leaf_node_t *merge_prev; // ... the left leaf of the merge this leaf is the right one of
 
   leaf_node_t(nsTimer *clk = NULL, int i = 0)
   {
     number = 0;
     bitmap = 0;
+    frozen = 0;
+    split = 0;
+    copied = 0;
     data = (data_node_t *)data_alloc(sizeof(data_node_t));
     log = NULL;
     next = NULL;
-    copy_flag = sync_flag = prev_flag = fin_flag = 0;
+    sibling = NULL;
+    copy_flag = sync_flag = prev_flag = fin_flag = retired = 0;
+    merge_retry = 0;
+    deleted = 0;
+    skip = 0;
+    merge_next = merge_prev = NULL;
   }
 
   uint8_t get_number()
@@ -263,40 +479,162 @@ public:
     return number;
   }
 
+  // commit slot pos; false if the slot missed the split snapshot and has to be redone in the new leaf
   bool set_slot(int pos)
   {
-    uint32_t prev, curr;
-    do
-    {
-      prev = bitmap;
-      if (prev & (1 << 31))
-        return false;
-      curr = (prev | (1llu << pos));
-    } while (!__sync_bool_compare_and_swap(&bitmap, prev, curr));
+    if (split)
+      return false;
+    __sync_fetch_and_or(&bitmap, 1llu << pos);
+    // the splitter raises split before it reads bitmap, so the slot is in its snapshot
+    if (!__atomic_load_n(&split, __ATOMIC_SEQ_CST))
+      return true;
+    if (wait_frozen() & (1llu << pos))
+      return true;
+    // the split drops the slot, take it back so that nothing acts on it here
+    __sync_fetch_and_and(&bitmap, ~(1llu << pos));
+    return false;
+  }
 
-    return true;
+  // commit several slots with one CAS, all or none of them are in the split snapshot
+  bool set_slots(uint64_t mask)
+  {
+    if (split)
+      return false;
+    __sync_fetch_and_or(&bitmap, mask);
+    if (!__atomic_load_n(&split, __ATOMIC_SEQ_CST))
+      return true;
+    if ((wait_frozen() & mask) == mask)
+      return true;
+    __sync_fetch_and_and(&bitmap, ~mask);
+    return false;
   }
 
   void set_split_bit()
   {
-    uint32_t prev, curr;
-    do
+    if (split)
+      return;
+    if (__sync_bool_compare_and_swap(&split, 0, 1))
     {
-      prev = bitmap;
-      if (prev & (1 << 31))
-        return;
-      curr = (prev | (1llu << 31));
-    } while (!__sync_bool_compare_and_swap(&bitmap, prev, curr));
+      // no slot commits after this snapshot, copy and sync only see these slots
+      __atomic_store_n(&frozen, __atomic_load_n(&bitmap, __ATOMIC_SEQ_CST) | FROZEN, __ATOMIC_RELEASE);
+    }
+  }
+
+  // raise split for a merge without publishing the snapshot, the merger does that with freeze()
+  bool try_split_bit()
+  {
+    return split == 0 && __sync_bool_compare_and_swap(&split, 0, 1);
+  }
+
+  void freeze(uint64_t snapshot)
+  {
+    __atomic_store_n(&frozen, snapshot | FROZEN, __ATOMIC_RELEASE);
+  }
+
+  // the slots that take part in the split
+  uint64_t wait_frozen()
+  {
+    uint64_t f;
+    while (!((f = __atomic_load_n(&frozen, __ATOMIC_ACQUIRE)) & FROZEN))
+      asm("pause");
+    return f & FULL;
+  }
+
+  // the committed slots readers may act on; once split is raised only the ones in the
+  // snapshot, a slot that missed it is redone in the new leaf
+  uint64_t valid_slots()
+  {
+    uint64_t b = __atomic_load_n(&bitmap, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&split, __ATOMIC_SEQ_CST))
+      b &= wait_frozen();
+    return b & FULL;
+  }
+
+  // about the live entries, removes only count the ones they hit
+  int live()
+  {
+    int n = __builtin_popcountll(bitmap & FULL) - (int)deleted;
+    return n > 0 ? n : 0;
+  }
+
+  // the live entries of a frozen leaf
+  int count_live(uint64_t valid)
+  {
+    int n = 0;
+    for (int i = 0; i < LEAF_NODE_SIZE; i++)
+      n += (valid & (1llu << i)) && data->kv[i].key != 0;
+    return n;
   }
 
   bool check_slot(int i)
   {
-    return ((bitmap & (1 << i)) != 0);
+    return ((bitmap & (1llu << i)) != 0);
   }
 
   bool check_split()
   {
-    return ((bitmap & (1 << 31)) != 0);
+    return (split != 0);
+  }
+
+  // take a free slot, one in the XPLine stripe if there is one; -1 if the leaf is full.
+  // number becomes the highest slot taken plus one
+  int claim_slot(int stripe)
+  {
+    uint64_t mine = (((1llu << XPLINE_SLOTS) - 1) << (stripe * XPLINE_SLOTS)) & FULL;
+    uint64_t c, free;
+    int pos;
+    do
+    {
+      c = claimed;
+      free = ~c & mine;
+      if (free == 0)
+        free = ~c & FULL;
+      if (free == 0)
+        return -1;
+      pos = __builtin_ctzll(free);
+    } while (!__sync_bool_compare_and_swap(&claimed, c, c | (1llu << pos)));
+    uint32_t n;
+    while ((n = number) < (uint32_t)pos + 1 && !__sync_bool_compare_and_swap(&number, n, pos + 1))
+      ;
+    return pos;
+  }
+
+  // probe the fingerprints, then only read the PM keys of committed matches
+  int find_item(entry_key_t key, uint8_t hash, fp_probe_t probe = fp_probe)
+  {
+    // committed slots are always below number
+    int n = number < LEAF_NODE_SIZE ? number : LEAF_NODE_SIZE;
+    uint64_t match = probe(finger_prints, hash, n) & valid_slots();
+    while (match)
+    {
+      int i = __builtin_ctzll(match);
+      if (data->kv[i].key == key)
+      {
+        return i;
+      }
+      match &= match - 1;
+    }
+    return -1;
+  }
+
+  // prefetch the slots find_item will read for hash
+  void prefetch_item(uint8_t hash, fp_probe_t probe = fp_probe)
+  {
+    int n = number < LEAF_NODE_SIZE ? number : LEAF_NODE_SIZE;
+    uint64_t match = probe(finger_prints, hash, n) & valid_slots();
+    while (match)
+    {
+      prefetch(&data->kv[__builtin_ctzll(match)]);
+      match &= match - 1;
+    }
+  }
+
+  // fill a slot of a node that is not visible to other threads yet
+  void fill_slot(int pos, entry_key_t key, char *ptr, uint8_t hash)
+  {
+    data->kv[pos].key = key;
+    data->kv[pos].ptr = ptr;
+    finger_prints[pos] = hash;
   }
 
   void print_node()
@@ -309,7 +647,8 @@ public:
     printf("low_key:%lu\n", low_key);
     printf("high_key:%lu\n", high_key);
     printf("number:%d\n", number);
-    printf("bitmap:%x\n", bitmap);
+    printf("bitmap:%lx\n", bitmap);
+    printf("frozen:%lx\n", frozen);
     printf("next:%p\n", (leaf_node_t *)next);
   }
   void check_node(entry_key_t low)
@@ -324,19 +663,166 @@ public:
   }
 };
 
+// leaves a thread remembers across operations, at most LEAF_CACHE_MAX, 0 disables the cache
+int leaf_cache_size = 0;
+
+// the leaves one thread used last, most recent first. A leaf reached in an operation that
+// entered epoch e is freed in epoch e + 2 at the earliest, so the leaves are only trusted
+// by operations that entered the same epoch; a split leaf is dropped.
+struct alignas(64) leaf_cache_t
+{
+  btree *tree;
+  uint64_t epoch;
+  int n;
+  leaf_node_t *leaves[LEAF_CACHE_MAX];
+  uint64_t hits;
+  uint64_t misses;
+};
+
+static per_thread_t<leaf_cache_t> leaf_caches;
+
+static leaf_cache_t *my_leaf_cache()
+{
+  return leaf_caches.mine();
+}
+
+// exit hook, the next owner of the slot starts with an empty cache
+static void leaf_cache_release(void *arg, uint32_t slot)
+{
+  leaf_caches[slot].n = 0;
+}
+
+static const bool leaf_cache_hooked = (thread_slots.at_exit(leaf_cache_release, NULL), true);
+
+static inline void leaf_cache_report()
+{
+  uint64_t hits = 0, misses = 0;
+  for (uint32_t i = 0; i < leaf_caches.size(); i++)
+  {
+    hits += leaf_caches[i].hits;
+    misses += leaf_caches[i].misses;
+  }
+  if (leaf_cache_size == 0)
+    printf("[LEAF CACHE]\tdisabled\n");
+  else
+    printf("[LEAF CACHE]\t%d leaves per thread, hits %lu, misses %lu, hit rate %.2f%%\n", leaf_cache_size,
+           hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+}
+
+// inserts take the free slots of the XPLine their thread is striped to first, so threads that insert
+// into one leaf at the same time write to different XPLines; set before the tree is used
+bool xpline_stripe = false;
+static uint32_t leaf_stripe_threads = 0;
+static __thread int leaf_stripe_tls = -1;
+
+static int my_leaf_stripe()
+{
+  if (leaf_stripe_tls < 0)
+    leaf_stripe_tls = __sync_fetch_and_add(&leaf_stripe_threads, 1) % LEAF_STRIPES;
+  return leaf_stripe_tls;
+}
+
+// a full leaf with fewer live entries than this share of its slots is compacted into one new leaf
+// instead of split into two, 0 always splits
+float leaf_compact_ratio = 0.5;
+
+// a remove that leaves fewer live entries than this share of the slots merges the leaf with a neighbour
+// under the same parent if both fit into one leaf at most twice as full, 0 never merges
+float leaf_merge_ratio = 0.25;
+
+// split copies build the new data nodes in DRAM and stream them to PM with non-temporal
+// stores, NBTREE_NO_NT_COPY=1 stores into PM through the cache instead
+static const bool split_nt_copy = getenv("NBTREE_NO_NT_COPY") == NULL;
+
+// splits the calling thread copied itself, helped ones are not counted
+struct alignas(64) split_stats_t
+{
+  uint64_t splits;
+  uint64_t compactions; // ... of them into one leaf
+  uint64_t merges;       // pairs of underfull leaves merged into one
+  uint64_t inner_merges; // inner nodes merged into their left sibling
+  uint64_t copy_ns;
+  uint64_t split_ns;
+  uint64_t pm_bytes;  // bytes the copies stored to PM
+  uint64_t rfo_bytes; // PM bytes read for ownership before they were stored
+};
+
+static per_thread_t<split_stats_t> split_stats;
+
+static split_stats_t *my_split_stats()
+{
+  return split_stats.mine();
+}
+
+static inline void split_report()
+{
+  split_stats_t sum = {};
+  for (uint32_t i = 0; i < split_stats.size(); i++)
+  {
+    sum.splits += split_stats[i].splits;
+    sum.compactions += split_stats[i].compactions;
+    sum.merges += split_stats[i].merges;
+    sum.inner_merges += split_stats[i].inner_merges;
+    sum.copy_ns += split_stats[i].copy_ns;
+    sum.split_ns += split_stats[i].split_ns;
+    sum.pm_bytes += split_stats[i].pm_bytes;
+    sum.rfo_bytes += split_stats[i].rfo_bytes;
+  }
+  uint64_t n = sum.splits ? sum.splits : 1;
+  printf("[SPLIT]\t%s copy, splits %lu (%lu compactions), copy %.0f ns, split %.0f ns on average\n",
+         split_nt_copy ? "non-temporal" : "cached", sum.splits, sum.compactions, (double)sum.copy_ns / n, (double)sum.split_ns / n);
+  printf("[SPLIT]\tmerges: %lu leaf pairs, %lu inner nodes\n", sum.merges, sum.inner_merges);
+  printf("[SPLIT]\tPM bytes stored %lu MB (%lu per split), read for ownership %lu MB (%lu per split)\n",
+         sum.pm_bytes >> 20, sum.pm_bytes / n, sum.rfo_bytes >> 20, sum.rfo_bytes / n);
+}
+
+// the grace period of a replaced leaf is over, give it and its data node back
+void free_leaf(void *p)
+{
+  leaf_node_t *leaf = (leaf_node_t *)p;
+  mem_stats_t *st = my_mem_stats();
+  st->freed_leaves++;
+  st->freed_data++;
+  pm_heap.free(leaf->data);
+  leaf_free(leaf);
+}
+
+// hand a replaced leaf and its data node to the epoch manager
+static void retire_leaf(leaf_node_t *leaf)
+{
+  mem_stats_t *st = my_mem_stats();
+  st->retired_leaves++;
+  st->retired_data++;
+  epoch_mgr.retire(leaf, free_leaf);
+}
+
+// a copy that lost the race to commit, no other thread has seen it: give it back at once
+static void drop_leaf(leaf_node_t *leaf)
+{
+  mem_stats_t *st = my_mem_stats();
+  st->leaves--;
+  st->data_nodes--;
+  pm_heap.free(leaf->data);
+  leaf_free(leaf);
+}
+
 class inner_node_t : public page
 {
 private:
   header hdr;                 // header in persistent memory, 16 bytes
-  entry records[cardinality]; // slots in persistent memory, 16 bytes * n
+  entry records[cardinality]; // slots in persistent memory, 16 bytes * n, or entry32s in a compact node
 
 public:
   friend class btree;
 
-  inner_node_t(uint32_t level = 0)
+  // a node for the keys in [low, high), compact if they share the high 32 bits
+  inner_node_t(uint32_t level, entry_key_t low, entry_key_t high)
   {
     hdr.level = level;
-    records[0].ptr = NULL;
+    hdr.low_key = low;
+    hdr.high_key = high;
+    hdr.compact = can_compact(low, high);
+    set_ptr(0, NULL);
   }
 
   // this is called when tree grows
@@ -344,19 +830,129 @@ public:
   {
     hdr.leftmost_ptr = left;
     hdr.level = level;
-    records[0].key = key;
-    records[0].ptr = (char *)right;
-    records[1].ptr = NULL;
+    set_key(0, key);
+    set_ptr(0, (char *)right);
+    set_ptr(1, NULL);
 
     hdr.last_index = 0;
   }
 
   void *operator new(size_t size)
   {
-    void *ret;
-    int x;
-    x = posix_memalign(&ret, 64, size);
-    return ret;
+    my_mem_stats()->inner_nodes++;
+    return dram_arena.alloc(size);
+  }
+
+  static bool can_compact(entry_key_t low, entry_key_t high)
+  {
+    return inner_compact && high > low && KEY_PREFIX(low) == KEY_PREFIX(high - 1) && dram_arena.short_handles();
+  }
+
+  inline int capacity()
+  {
+    return hdr.compact ? cardinality_compact : cardinality;
+  }
+
+  inline entry_key_t key_at(int i)
+  {
+    if (hdr.compact)
+      return KEY_PREFIX(hdr.low_key) | ((entry32 *)records)[i].key;
+    return records[i].key;
+  }
+
+  inline char *ptr_at(int i)
+  {
+    if (hdr.compact)
+      return dram_arena.from_handle(((entry32 *)records)[i].ptr);
+    return records[i].ptr;
+  }
+
+  inline void set_key(int i, entry_key_t key)
+  {
+    if (hdr.compact)
+      ((entry32 *)records)[i].key = (uint32_t)key;
+    else
+      records[i].key = key;
+  }
+
+  inline void set_ptr(int i, char *ptr)
+  {
+    if (hdr.compact)
+      ((entry32 *)records)[i].ptr = dram_arena.handle(ptr);
+    else
+      records[i].ptr = ptr;
+  }
+
+  // first record whose key is above key, see inner_search.h
+  inline int probe(entry_key_t key)
+  {
+    if (hdr.compact)
+    {
+      // a key past the prefix is past every record, the caller moves on to the sibling
+      entry_key_t suffix = key - KEY_PREFIX(hdr.low_key);
+      return inner_probe_compact((const uint64_t *)records, suffix > 0xffffffffllu ? 0xffffffffllu : suffix,
+                                 cardinality_compact);
+    }
+    return inner_probe((const uint64_t *)records, key, cardinality);
+  }
+
+  // readers take a version without the lock bit and retry if it changed after the read
+  inline uint32_t read_begin()
+  {
+    uint32_t v;
+    int spins = 0;
+    while ((v = __atomic_load_n(&hdr.version, __ATOMIC_ACQUIRE)) & VERSION_LOCKED)
+    {
+      // the holder may have been preempted
+      if (++spins % 64 == 0)
+        sched_yield();
+      else
+        asm("pause");
+    }
+    return v;
+  }
+
+  inline bool read_validate(uint32_t v)
+  {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&hdr.version, __ATOMIC_RELAXED) == v;
+  }
+
+  // writers lock only the node they modify; with INNER_HTM the lock is elided by a transaction,
+  // unless the holder waits for other threads or locks more nodes (elide = false)
+  inline void write_lock(bool elide = true)
+  {
+#ifdef INNER_HTM
+    if (elide && htm_try_elide(&hdr.version, VERSION_LOCKED))
+      return;
+#endif
+    while (true)
+    {
+      uint32_t v = read_begin();
+      if (__sync_bool_compare_and_swap(&hdr.version, v, v | VERSION_LOCKED))
+        return;
+    }
+  }
+
+  // write_lock without waiting, false if another writer holds the node
+  inline bool try_write_lock()
+  {
+    uint32_t v = hdr.version;
+    return !(v & VERSION_LOCKED) && __sync_bool_compare_and_swap(&hdr.version, v, v | VERSION_LOCKED);
+  }
+
+  inline void write_unlock()
+  {
+#ifdef INNER_HTM
+    // an elided lock never shows the lock bit
+    if (!(hdr.version & VERSION_LOCKED))
+    {
+      hdr.version += VERSION_STEP;
+      htm_commit();
+      return;
+    }
+#endif
+    __atomic_store_n(&hdr.version, (hdr.version + VERSION_STEP) & ~VERSION_LOCKED, __ATOMIC_RELEASE);
   }
 
   inline int count()
@@ -368,7 +964,7 @@ public:
       previous_switch_counter = hdr.switch_counter;
       count = hdr.last_index + 1;
 
-      while (count >= 0 && records[count].ptr != NULL)
+      while (count >= 0 && ptr_at(count) != NULL)
       {
         if (IS_FORWARD(previous_switch_counter))
           ++count;
@@ -379,7 +975,7 @@ public:
       if (count < 0)
       {
         count = 0;
-        while (records[count].ptr != NULL)
+        while (ptr_at(count) != NULL)
         {
           ++count;
         }
@@ -390,6 +986,12 @@ public:
     return count;
   }
 
+  // the i-th child from the left, 0 is leftmost_ptr
+  inline page *child(int i)
+  {
+    return (i == 0) ? hdr.leftmost_ptr : (page *)ptr_at(i - 1);
+  }
+
   inline bool remove_key(entry_key_t key)
   {
     // Set the switch_counter
@@ -398,18 +1000,18 @@ public:
 
     bool shift = false;
     int i;
-    for (i = 0; records[i].ptr != NULL; ++i)
+    for (i = 0; ptr_at(i) != NULL; ++i)
     {
-      if (!shift && records[i].key == key)
+      if (!shift && key_at(i) == key)
       {
-        records[i].ptr = (i == 0) ? (char *)hdr.leftmost_ptr : records[i - 1].ptr;
+        set_ptr(i, (i == 0) ? (char *)hdr.leftmost_ptr : ptr_at(i - 1));
         shift = true;
       }
 
       if (shift)
       {
-        records[i].key = records[i + 1].key;
-        records[i].ptr = records[i + 1].ptr;
+        set_key(i, key_at(i + 1));
+        set_ptr(i, ptr_at(i + 1));
       }
     }
 
@@ -439,12 +1041,9 @@ public:
     // FAST
     if (*num_entries == 0)
     { // this page is empty
-      entry *new_entry = (entry *)&records[0];
-      entry *array_end = (entry *)&records[1];
-      new_entry->key = (entry_key_t)key;
-      new_entry->ptr = (char *)ptr;
-
-      array_end->ptr = (char *)NULL;
+      set_key(0, key);
+      set_ptr(0, ptr);
+      set_ptr(1, NULL);
 
       // if (hdr.pred_ptr != NULL)
       //   *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
@@ -452,25 +1051,25 @@ public:
     else
     {
       int i = *num_entries - 1, inserted = 0;
-      records[*num_entries + 1].ptr = records[*num_entries].ptr;
+      set_ptr(*num_entries + 1, ptr_at(*num_entries));
 
       // FAST
       for (i = *num_entries - 1; i >= 0; i--)
       {
-        if (key < records[i].key)
+        if (key < key_at(i))
         {
-          records[i + 1].ptr = records[i].ptr;
-          records[i + 1].key = records[i].key;
+          set_ptr(i + 1, ptr_at(i));
+          set_key(i + 1, key_at(i));
         }
         else
         {
-          records[i + 1].ptr = records[i].ptr;
-          records[i + 1].key = key;
-          records[i + 1].ptr = ptr;
+          set_ptr(i + 1, ptr_at(i));
+          set_key(i + 1, key);
+          set_ptr(i + 1, ptr);
 
           if (left != NULL)
           {
-            records[i].ptr = left;
+            set_ptr(i, left);
           }
           inserted = 1;
           break;
@@ -478,9 +1077,9 @@ public:
       }
       if (inserted == 0)
       {
-        records[0].ptr = (char *)hdr.leftmost_ptr;
-        records[0].key = key;
-        records[0].ptr = ptr;
+        set_ptr(0, (char *)hdr.leftmost_ptr);
+        set_key(0, key);
+        set_ptr(0, ptr);
         if (left != NULL)
         {
           hdr.leftmost_ptr = (page *)left;
@@ -497,63 +1096,68 @@ public:
 
   // revised
   // Insert a new key in the inner node- FAST and FAIR
+  // child is the locked node that split into this level, it is unlocked once the node for key is locked
   page *store(btree *bt, char *left, entry_key_t key, char *right,
-              bool flush, bool with_lock, page *invalid_sibling = NULL, leaf_node_t *leaf = NULL)
+              bool flush, bool with_lock, page *invalid_sibling = NULL, leaf_node_t *leaf = NULL,
+              inner_node_t *child = NULL)
   {
-    // 1. HTM begin
-    htm_lock l;
+    // 1. lock this node
     if (with_lock)
     {
-      l.acquire(bt->mtx);
+      write_lock();
       if (leaf)
       {
         if (leaf->fin_flag)
         {
-          l.release();
+          write_unlock();
           return NULL;
         }
       }
     }
-    if (hdr.is_deleted)
+    if (hdr.version & VERSION_OBSOLETE)
     {
+      // merged into the left sibling, which holds the whole range now
       if (with_lock)
-      {
-        l.release();
-      }
-      return NULL;
+        write_unlock();
+      return hdr.pred_ptr->store(bt, left, key, right, true, with_lock, invalid_sibling, leaf, child);
     }
 
     // 2. Check if the leaf is correct
     if (key >= hdr.high_key)
     {
       if (with_lock)
-        l.release();
+        write_unlock();
       if (hdr.sibling_ptr && (hdr.sibling_ptr != invalid_sibling))
       {
         // should pass the leaf parameter to sibling pointer
         return hdr.sibling_ptr->store(bt, left, key, right,
-                                      true, with_lock, invalid_sibling, leaf);
+                                      true, with_lock, invalid_sibling, leaf, child);
       }
-      else
-        return NULL;
+      if (child)
+        child->write_unlock();
+      return NULL;
     }
     else if (key < hdr.low_key)
     {
       if (with_lock)
-        l.release();
+        write_unlock();
       if (hdr.pred_ptr && (hdr.pred_ptr != invalid_sibling))
       {
         // should pass the leaf parameter to sibling pointer
         return hdr.pred_ptr->store(bt, left, key, right,
-                                   true, with_lock, invalid_sibling, leaf);
+                                   true, with_lock, invalid_sibling, leaf, child);
       }
-      else
-        return NULL;
+      if (child)
+        child->write_unlock();
+      return NULL;
     }
+    // lock coupling: the split child is released only now that its separator has a locked home
+    if (child)
+      child->write_unlock();
 
     // 3. Insert
     register int num_entries = count();
-    if (num_entries < cardinality - 1)
+    if (num_entries < capacity() - 1)
     {
       // FAST
       insert_key(left, key, right, &num_entries);
@@ -564,33 +1168,31 @@ public:
           assert(!leaf->fin_flag);
           leaf->fin_flag = 1;
         }
-        l.release();
+        write_unlock();
       }
       return this;
     }
     else
     {
       // FAIR
-      inner_node_t *sibling = new inner_node_t(hdr.level);
       register int m = (int)ceil(num_entries / 2);
-      entry_key_t split_key = records[m].key;
+      entry_key_t split_key = key_at(m);
+      inner_node_t *sibling = new inner_node_t(hdr.level, split_key, hdr.high_key);
 
       int sibling_cnt = 0;
       for (int i = m + 1; i < num_entries; ++i)
       {
-        sibling->insert_key(NULL, records[i].key, records[i].ptr, &sibling_cnt, false);
+        sibling->insert_key(NULL, key_at(i), ptr_at(i), &sibling_cnt, false);
       }
-      sibling->hdr.leftmost_ptr = (page *)records[m].ptr;
+      sibling->hdr.leftmost_ptr = (page *)ptr_at(m);
       sibling->hdr.sibling_ptr = hdr.sibling_ptr;
       sibling->hdr.pred_ptr = this;
       if (sibling->hdr.sibling_ptr != NULL)
         sibling->hdr.sibling_ptr->hdr.pred_ptr = sibling;
-      sibling->hdr.high_key = hdr.high_key;
-      sibling->hdr.low_key = split_key;
       hdr.sibling_ptr = sibling;
       hdr.high_key = split_key;
 
-      records[m].ptr = NULL;
+      set_ptr(m, NULL);
       hdr.last_index = m - 1;
       num_entries = hdr.last_index + 1;
       page *ret;
@@ -612,35 +1214,30 @@ public:
         sibling->insert_key(left, key, right, &sibling_cnt);
         ret = sibling;
       }
+      if (with_lock && leaf)
+      {
+        assert(!leaf->fin_flag);
+        leaf->fin_flag = 1;
+      }
       // Set a new root or insert the split key to the parent
       if (bt->root == (char *)this)
       {
-        // only one node can update the root ptr
-        printf("Root height:%d!\n", hdr.level + 2);
+        // only the holder of the root lock can update the root ptr
         inner_node_t *new_root = new inner_node_t((page *)this, split_key, sibling,
                                                   hdr.level + 1);
         bt->setNewRoot((char *)new_root);
         if (with_lock)
-        {
-          if (leaf)
-          {
-            assert(!leaf->fin_flag);
-            leaf->fin_flag = 1;
-          }
-          l.release();
-        }
+          write_unlock();
+        printf("Root height:%d!\n", hdr.level + 2);
+      }
+      else if (with_lock)
+      {
+        // keep this node locked until the parent is
+        bt->btree_insert_internal(NULL, split_key, (char *)sibling,
+                                  hdr.level + 1, NULL, this);
       }
       else
       {
-        if (with_lock)
-        {
-          if (leaf)
-          {
-            assert(!leaf->fin_flag);
-            leaf->fin_flag = 1;
-          }
-          l.release();
-        }
         bt->btree_insert_internal(NULL, split_key, (char *)sibling,
                                   hdr.level + 1);
       }
@@ -649,17 +1246,61 @@ public:
     }
   }
 
+  // a compaction rewrote the leaf old (whose range holds key) into now, swing its pointer; the separators stay
+  void replace_child(entry_key_t key, page *old, page *now, leaf_node_t *leaf)
+  {
+    write_lock();
+    if (leaf->fin_flag)
+    {
+      write_unlock();
+      return;
+    }
+    if (hdr.version & VERSION_OBSOLETE)
+    {
+      write_unlock();
+      return hdr.pred_ptr->replace_child(key, old, now, leaf);
+    }
+    if (key >= hdr.high_key && hdr.sibling_ptr)
+    {
+      write_unlock();
+      return hdr.sibling_ptr->replace_child(key, old, now, leaf);
+    }
+    if (key < hdr.low_key && hdr.pred_ptr)
+    {
+      write_unlock();
+      return hdr.pred_ptr->replace_child(key, old, now, leaf);
+    }
+    if (hdr.leftmost_ptr == old)
+      hdr.leftmost_ptr = now;
+    else
+    {
+      for (int i = 0; ptr_at(i) != NULL; i++)
+      {
+        if (ptr_at(i) == (char *)old)
+        {
+          set_ptr(i, (char *)now);
+          break;
+        }
+      }
+    }
+    leaf->fin_flag = 1;
+    write_unlock();
+  }
+
   page *linear_search(entry_key_t key, bool debug = false)
   {
     int i = 1;
     uint8_t previous_switch_counter;
+    uint32_t version;
     char *ret = NULL;
     char *t;
     entry_key_t k;
 
     do
     {
-
+      version = read_begin();
+      if (version & VERSION_OBSOLETE)
+        return hdr.pred_ptr->linear_search(key, debug);
       previous_switch_counter = hdr.switch_counter;
       ret = NULL;
       if (IS_FORWARD(previous_switch_counter))
@@ -675,10 +1316,10 @@ public:
         }
         // modified by zbw: first read the left pointer, then compare the key
       Again1:
-        if (key < (k = records[0].key))
+        if (key < (k = key_at(0)))
         {
           t = (char *)hdr.leftmost_ptr;
-          if (k == records[0].key)
+          if (k == key_at(0))
           {
             ret = t;
             if (debug)
@@ -691,12 +1332,25 @@ public:
           }
         }
 
-        for (i = 1; records[i].ptr != NULL; ++i)
+        // vector probe, the key it stopped at is checked the same way the loop below checks it
+        i = debug ? capacity() : probe(key);
+        if (i < capacity())
         {
-          if (key < (k = records[i].key))
+          k = key_at(i);
+          t = ptr_at(i - 1);
+          if (ptr_at(i) == NULL || (key < k && k == key_at(i)))
           {
-            t = records[i - 1].ptr;
-            if (k == records[i].key)
+            ret = t;
+            continue;
+          }
+        }
+
+        for (i = 1; ptr_at(i) != NULL; ++i)
+        {
+          if (key < (k = key_at(i)))
+          {
+            t = ptr_at(i - 1);
+            if (k == key_at(i))
             {
               ret = t;
               if (debug)
@@ -714,7 +1368,7 @@ public:
 
         if (!ret)
         {
-          ret = records[i - 1].ptr;
+          ret = ptr_at(i - 1);
           if (debug)
             printf("%lu is in pos = rightmost of %p, that is %p\n", key, this, ret);
           continue;
@@ -724,11 +1378,11 @@ public:
       { // search from right to left
         for (i = count() - 1; i >= 0; --i)
         {
-          if (key >= (k = records[i].key))
+          if (key >= (k = key_at(i)))
           {
             if (i == 0)
             {
-              if ((char *)hdr.leftmost_ptr != (t = records[i].ptr))
+              if ((char *)hdr.leftmost_ptr != (t = ptr_at(i)))
               {
                 ret = t;
                 break;
@@ -736,7 +1390,7 @@ public:
             }
             else
             {
-              if (records[i - 1].ptr != (t = records[i].ptr))
+              if (ptr_at(i - 1) != (t = ptr_at(i)))
               {
                 ret = t;
                 break;
@@ -745,12 +1399,7 @@ public:
           }
         }
       }
-      if (hdr.switch_counter != previous_switch_counter)
-      {
-        printf("search %lu retry!\n", key);
-      }
-      // assert(hdr.switch_counter == previous_switch_counter);
-    } while (hdr.switch_counter != previous_switch_counter);
+    } while (!read_validate(version));
 
     if ((t = (char *)hdr.sibling_ptr) != NULL)
     {
@@ -760,13 +1409,13 @@ public:
       }
     }
 
+    // a node merges can leave without records, a backward read below every key
     if (ret)
     {
       return (page *)ret;
     }
     else
     {
-      assert(ret);
       return (page *)hdr.leftmost_ptr;
     }
 
@@ -777,6 +1426,7 @@ public:
   {
     int i = 1;
     uint8_t previous_switch_counter;
+    uint32_t version;
     char *ret = NULL;
     char *t, *t1;
     entry_key_t k, k1;
@@ -787,6 +1437,12 @@ public:
 
     do
     {
+      version = read_begin();
+      if (version & VERSION_OBSOLETE)
+      {
+        *parent = hdr.pred_ptr;
+        return hdr.pred_ptr->linear_search_pred(key, pred, parent, debug);
+      }
       previous_switch_counter = hdr.switch_counter;
       ret = NULL;
       if (debug)
@@ -806,14 +1462,14 @@ public:
 
       Again2:
         *pred = NULL;
-        if (key < (k = records[0].key))
+        if (key < (k = key_at(0)))
         {
           t = (char *)hdr.leftmost_ptr;
-          if (k == records[0].key)
+          if (k == key_at(0))
           {
             if (hdr.pred_ptr != NULL)
             {
-              *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
+              *pred = (char *)hdr.pred_ptr->child(hdr.pred_ptr->count());
               pred_pos = -1;
               if (debug)
                 printf("line 798, *pred=%p\n", *pred);
@@ -833,12 +1489,26 @@ public:
             printf("line 808, *pred=%p\n", *pred);
         }
 
-        for (i = 1; records[i].ptr != NULL; ++i)
+        i = debug ? capacity() : probe(key);
+        if (i < capacity())
+        {
+          k = key_at(i);
+          t = ptr_at(i - 1);
+          if (ptr_at(i) == NULL || (key < k && k == key_at(i)))
+          {
+            if (i >= 2)
+              *pred = ptr_at(i - 2);
+            ret = t;
+            continue;
+          }
+        }
+
+        for (i = 1; ptr_at(i) != NULL; ++i)
         {
-          if (key < (k = records[i].key))
+          if (key < (k = key_at(i)))
           {
-            t = records[i - 1].ptr;
-            if (k == records[i].key)
+            t = ptr_at(i - 1);
+            if (k == key_at(i))
             {
               ret = t;
               break;
@@ -850,7 +1520,7 @@ public:
           }
           else
           {
-            *pred = records[i - 1].ptr;
+            *pred = ptr_at(i - 1);
             if (debug)
               printf("line 824, *pred=%p\n", *pred);
           }
@@ -858,7 +1528,7 @@ public:
 
         if (!ret)
         {
-          ret = records[i - 1].ptr;
+          ret = ptr_at(i - 1);
           continue;
         }
       }
@@ -867,22 +1537,20 @@ public:
         bool once = true;
         for (i = count() - 1; i >= 0; --i)
         {
-          if (key >= (k = records[i].key))
+          if (key >= (k = key_at(i)))
           {
             // find the correct position
             if (i == 0)
             {
-              if ((char *)hdr.leftmost_ptr != (t = records[i].ptr))
+              if ((char *)(*pred = (char *)hdr.leftmost_ptr) != (t = ptr_at(i)))
               {
                 ret = t;
-                if (hdr.pred_ptr != NULL)
-                  *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
                 break;
               }
             }
             else
             {
-              if ((*pred = records[i - 1].ptr) != (t = records[i].ptr))
+              if ((*pred = ptr_at(i - 1)) != (t = ptr_at(i)))
               {
                 ret = t;
                 break;
@@ -891,7 +1559,7 @@ public:
           }
         }
       }
-    } while (hdr.switch_counter != previous_switch_counter);
+    } while (!read_validate(version));
 
     if ((t = (char *)hdr.sibling_ptr) != NULL)
     {
@@ -902,15 +1570,13 @@ public:
         return ((inner_node_t *)t)->linear_search_pred(key, pred, parent, debug);
       }
     }
-    assert(ret);
     if (ret)
     {
       return ret;
     }
-    else
-      return (char *)hdr.leftmost_ptr;
-
-    return NULL;
+    // a node merges can leave without records, a backward read below every key
+    *pred = (hdr.pred_ptr != NULL) ? (char *)hdr.pred_ptr->child(hdr.pred_ptr->count()) : NULL;
+    return (char *)hdr.leftmost_ptr;
   }
   // print a node
   void print()
@@ -924,10 +1590,10 @@ public:
       printf("leftmost_ptr:[%p] ", hdr.leftmost_ptr);
     }
 
-    for (int i = 0; records[i].ptr != NULL; ++i)
+    for (int i = 0; ptr_at(i) != NULL; ++i)
     {
-      printf("key[%d]:[%ld], ", i, records[i].key);
-      printf("ptr[%d]:[%p] ", i, records[i].ptr);
+      printf("key[%d]:[%ld], ", i, key_at(i));
+      printf("ptr[%d]:[%p] ", i, ptr_at(i));
     }
 
     printf("\n[%p] ", hdr.sibling_ptr);
@@ -936,21 +1602,104 @@ public:
   }
 };
 
+static_assert(sizeof(leaf_node_t) <= sizeof(inner_node_t), "a merged inner node is reused as a leaf");
+
+// the grace period of an inner node merged into its left sibling is over; the arena has no
+// free list of its own, the block goes to the leaves
+void free_inner(void *p)
+{
+  my_mem_stats()->freed_inner++;
+  leaf_free(p);
+}
+
+memory_stats_t btree::memory_stats()
+{
+  mem_stats_t sum = {};
+  for (uint32_t i = 0; i < mem_stats.size(); i++)
+  {
+    sum.leaves += mem_stats[i].leaves;
+    sum.data_nodes += mem_stats[i].data_nodes;
+    sum.inner_nodes += mem_stats[i].inner_nodes;
+    sum.retired_leaves += mem_stats[i].retired_leaves;
+    sum.retired_data += mem_stats[i].retired_data;
+    sum.retired_inner += mem_stats[i].retired_inner;
+    sum.freed_leaves += mem_stats[i].freed_leaves;
+    sum.freed_data += mem_stats[i].freed_data;
+    sum.freed_inner += mem_stats[i].freed_inner;
+    sum.keys += mem_stats[i].keys;
+  }
+  // the slots are read while other threads update them, keep the differences from going negative
+  memory_stats_t ms = {};
+  ms.leaves = sum.leaves > sum.retired_leaves ? sum.leaves - sum.retired_leaves : 0;
+  ms.data_nodes = sum.data_nodes > sum.retired_data ? sum.data_nodes - sum.retired_data : 0;
+  ms.inner_nodes = sum.inner_nodes > sum.retired_inner ? sum.inner_nodes - sum.retired_inner : 0;
+  ms.retired_leaves = sum.retired_leaves > sum.freed_leaves ? sum.retired_leaves - sum.freed_leaves : 0;
+  ms.retired_data = sum.retired_data > sum.freed_data ? sum.retired_data - sum.freed_data : 0;
+  ms.retired_inner = sum.retired_inner > sum.freed_inner ? sum.retired_inner - sum.freed_inner : 0;
+  ms.keys = (int64_t)sum.keys > 0 ? sum.keys : 0;
+
+  uint64_t leaf_size = (sizeof(leaf_node_t) + DRAM_ALIGN - 1) & ~(uint64_t)(DRAM_ALIGN - 1);
+  uint64_t inner_size = (sizeof(inner_node_t) + DRAM_ALIGN - 1) & ~(uint64_t)(DRAM_ALIGN - 1);
+  uint64_t data_size = pm_allocator_t::block_size(sizeof(data_node_t));
+  ms.dram_bytes = ms.leaves * leaf_size + ms.inner_nodes * inner_size;
+  ms.pm_bytes = ms.data_nodes * data_size;
+  ms.dram_retired_bytes = ms.retired_leaves * leaf_size + ms.retired_inner * inner_size;
+  ms.pm_retired_bytes = ms.retired_data * data_size;
+  ms.dram_arena_bytes = dram_arena.handed_out();
+  ms.pm_heap_bytes = pm_heap.chunk_bytes();
+  ms.leaf_fill = ms.leaves ? (double)ms.keys / (ms.leaves * LEAF_NODE_SIZE) : 0;
+  ms.dram_per_key = ms.keys ? (double)(ms.dram_bytes + ms.dram_retired_bytes) / ms.keys : 0;
+  ms.pm_per_key = ms.keys ? (double)(ms.pm_bytes + ms.pm_retired_bytes) / ms.keys : 0;
+  return ms;
+}
+
+static inline void memory_report()
+{
+  memory_stats_t ms = btree::memory_stats();
+  printf("[MEMORY]\tkeys %lu, leaves %lu (fill %.2f), data nodes %lu, inner nodes %lu\n",
+         ms.keys, ms.leaves, ms.leaf_fill, ms.data_nodes, ms.inner_nodes);
+  printf("[MEMORY]\tretired, not reclaimed yet: leaves %lu, data nodes %lu, inner nodes %lu\n",
+         ms.retired_leaves, ms.retired_data, ms.retired_inner);
+  printf("[MEMORY]\tDRAM nodes %lu MB + %lu MB retired (%.1f B/key), arena %lu MB\n",
+         ms.dram_bytes >> 20, ms.dram_retired_bytes >> 20, ms.dram_per_key, ms.dram_arena_bytes >> 20);
+  printf("[MEMORY]\tPM nodes %lu MB + %lu MB retired (%.1f B/key), heap %lu MB\n",
+         ms.pm_bytes >> 20, ms.pm_retired_bytes >> 20, ms.pm_per_key, ms.pm_heap_bytes >> 20);
+}
+
 /*
  * class btree
  */
 btree::btree()
 {
   c++;
-  anchor = new leaf_node_t;
+  // the pool has been created with pm_heap.create
+  meta = (pm_superblock_t *)pm_heap.alloc(sizeof(pm_superblock_t));
+  // from the arena like every leaf, compact inner nodes address their children by arena handles
+  anchor = new (leaf_alloc(sizeof(leaf_node_t))) leaf_node_t;
   anchor->high_key = (~0llu);
   anchor->low_key = 0;
   root = (char *)anchor;
-  data_anchor = anchor->data;
+  meta->data_anchor = anchor->data;
+  meta->skip = (pm_skip_table_t *)pm_heap.alloc(sizeof(pm_skip_table_t));
+  pm_persist(meta->skip.get(), sizeof(pm_skip_table_t));
+  meta->version = POOL_VERSION;
+  meta->clean = 0;
+  meta->magic = POOL_MAGIC;
+  pm_persist(meta, sizeof(pm_superblock_t));
+  pm_heap.set_root(meta);
   height = 1;
   printf("***** New NBTree **** \n");
 }
 
+btree::btree(pm_superblock_t *sb)
+{
+  c++;
+  meta = sb;
+  anchor = NULL;
+  this->root = NULL;
+  height = 0;
+}
+
 btree::~btree()
 {
 }
@@ -1009,18 +1758,459 @@ void btree::check()
   printf("correct!\n");
 }
 
+// rebuild the DRAM leaf of a data node in place, false if the node is empty and can be dropped
+bool btree::recover_leaf(leaf_node_t *leaf, data_node_t *node, bool first)
+{
+  int last = -1;
+  entry_key_t min_key = ~0llu;
+  for (int i = 0; i < LEAF_NODE_SIZE; i++)
+  {
+    if (node->kv[i].key != 0)
+    {
+      last = i;
+      if (node->kv[i].key < min_key)
+        min_key = node->kv[i].key;
+    }
+  }
+  if (last < 0 && !first)
+    return false;
+
+  memset(leaf, 0, sizeof(leaf_node_t));
+  leaf->data = node;
+  bool dirty = false;
+  for (int i = 0; i <= last; i++)
+  {
+    if (node->kv[i].key == 0)
+      continue;
+    // the split flags only mean something while the split runs
+    uint64_t value = (uint64_t)node->kv[i].ptr;
+    if (value & MASK)
+    {
+      node->kv[i].ptr = (char *)(value & (~MASK));
+      dirty = true;
+    }
+    leaf->finger_prints[i] = hashfunc(node->kv[i].key);
+    leaf->bitmap |= (1llu << i);
+  }
+  if (dirty)
+    pm_persist(node, sizeof(data_node_t));
+  leaf->number = last + 1;
+  leaf->claimed = FULL >> (LEAF_NODE_SIZE - leaf->number);
+  leaf->low_key = first ? 0 : min_key;
+  leaf->high_key = (~0llu);
+  return true;
+}
+
+// recovery worker, rebuilds the leaves of nodes[begin, end)
+void btree::recover_leaves(data_node_t **nodes, leaf_node_t *leaves, uint8_t *live, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; i++)
+  {
+    if (i + 1 < end)
+      nodes[i + 1]->_prefetch();
+    live[i] = recover_leaf(&leaves[i], nodes[i], i == 0);
+    if (live[i])
+      pm_heap.gc_mark(nodes[i]);
+  }
+}
+
+// build the inner levels above nodes bottom-up, every inner node gets at most fill keys
+void btree::build_inner_levels(std::vector<page *> &nodes, std::vector<entry_key_t> &low_keys, uint32_t level, float fill)
+{
+  // keys per node, a compact node holds twice as many
+  int fill_wide = std::max(1, std::min(cardinality - 1, (int)(cardinality * fill)));
+  int fill_compact = inner_compact ? std::max(1, std::min(cardinality_compact - 1, (int)(cardinality_compact * fill))) : fill_wide;
+  while (nodes.size() > 1)
+  {
+    std::vector<page *> parents;
+    std::vector<entry_key_t> parent_keys;
+    inner_node_t *prev = NULL;
+    // spread the children evenly over compact nodes, a node whose range has no common
+    // prefix is spread again over wide nodes
+    std::vector<size_t> ends;
+    size_t num_inner = (nodes.size() + fill_compact) / (fill_compact + 1);
+    size_t begin = 0;
+    for (size_t n = 0; n < num_inner; n++)
+    {
+      size_t end = nodes.size() * (n + 1) / num_inner;
+      if (!inner_node_t::can_compact(low_keys[begin], end < nodes.size() ? low_keys[end] : ~0llu))
+      {
+        size_t parts = (end - begin + fill_wide) / (fill_wide + 1);
+        for (size_t p = 1; p < parts; p++)
+          ends.push_back(begin + (end - begin) * p / parts);
+      }
+      ends.push_back(end);
+      begin = end;
+    }
+    size_t i = 0;
+    for (size_t n = 0; n < ends.size(); n++)
+    {
+      size_t end = ends[n];
+      inner_node_t *inner = new inner_node_t(level, low_keys[i], end < nodes.size() ? low_keys[end] : ~0llu);
+      inner->hdr.leftmost_ptr = nodes[i];
+      inner->hdr.pred_ptr = prev;
+      ++i;
+      int cnt = 0;
+      for (; i < end; ++i, ++cnt)
+      {
+        inner->set_key(cnt, low_keys[i]);
+        inner->set_ptr(cnt, (char *)nodes[i]);
+      }
+      inner->set_ptr(cnt, NULL);
+      inner->hdr.last_index = cnt - 1;
+      if (prev != NULL)
+      {
+        prev->hdr.sibling_ptr = inner;
+        prev->hdr.high_key = inner->hdr.low_key;
+      }
+      prev = inner;
+      parents.push_back((page *)inner);
+      parent_keys.push_back(inner->hdr.low_key);
+    }
+    nodes.swap(parents);
+    low_keys.swap(parent_keys);
+    ++level;
+  }
+  root = (char *)nodes[0];
+  height = level;
+}
+
+// point the skip table at every step-th leaf of a new chain
+void btree::skip_build(std::vector<page *> &leaves)
+{
+  pm_skip_table_t *table = meta->skip.get();
+  size_t step = std::max((size_t)SKIP_EVERY, (leaves.size() + SKIP_SLOTS - 1) / SKIP_SLOTS);
+  memset(table, 0, sizeof(pm_skip_table_t));
+  for (size_t i = step, s = 0; i < leaves.size() && s < SKIP_SLOTS; i += step, s++)
+  {
+    leaf_node_t *leaf = (leaf_node_t *)leaves[i];
+    leaf->skip = s + 1;
+    table->node[s] = leaf->data;
+  }
+  pm_persist(table, sizeof(pm_skip_table_t));
+}
+
+// a leaf new in the chain takes the next slot round-robin, the leaf that had it keeps its node there
+// until it is replaced
+void btree::skip_add(leaf_node_t *leaf)
+{
+  uint32_t s = (skip_splits / SKIP_EVERY) % SKIP_SLOTS;
+  if (!__sync_bool_compare_and_swap(&leaf->skip, 0, s + 1))
+    return;
+  pm_ptr<data_node_t> *slot = &meta->skip->node[s];
+  *slot = leaf->data;
+  pm_persist(slot, sizeof(data_node_t *));
+  asm_mfence();
+  // retired meanwhile, its data node goes back to the allocator
+  if (leaf->retired)
+  {
+    slot->cas(leaf->data, NULL);
+    pm_persist(slot, sizeof(data_node_t *));
+  }
+}
+
+// a retired leaf hands its slot to the leaf that replaced it, so the slot never names a freed node
+void btree::skip_move(leaf_node_t *leaf)
+{
+  if (leaf->skip == 0)
+    return;
+  leaf_node_t *to = leaf->log;
+  pm_ptr<data_node_t> *slot = &meta->skip->node[leaf->skip - 1];
+  bool moved = __sync_bool_compare_and_swap(&to->skip, 0, leaf->skip);
+  slot->cas(leaf->data, moved ? to->data : (data_node_t *)NULL);
+  pm_persist(slot, sizeof(data_node_t *));
+  asm_mfence();
+  if (moved && to->retired)
+  {
+    slot->cas(to->data, NULL);
+    pm_persist(slot, sizeof(data_node_t *));
+  }
+}
+
+// the node at link, after the synced splits and merges are made permanent
+static data_node_t *recover_link(pm_ptr<data_node_t> *link)
+{
+  while (*link != NULL)
+  {
+    data_node_t *node = *link;
+    if (node->log == NULL || !node->log_synced())
+      return node;
+    *link = node->log_node();
+    pm_persist(link, sizeof(data_node_t *));
+  }
+  return NULL;
+}
+
+// recovery worker, walks the chain from starts[g] up to the next start for every group g it takes
+void btree::recover_walk_groups(std::vector<data_node_t *> *starts, std::unordered_set<data_node_t *> *stops,
+                                std::vector<std::vector<data_node_t *>> *groups, std::vector<data_node_t *> *ends, size_t *next)
+{
+  size_t g;
+  while ((g = __sync_fetch_and_add(next, 1)) < starts->size())
+  {
+    std::vector<data_node_t *> &out = (*groups)[g];
+    data_node_t *node = (*starts)[g];
+    while (node != NULL)
+    {
+      // a split that has not been synced, the old node still holds everything
+      if (node->log != NULL)
+      {
+        node->log = NULL;
+        pm_persist(&node->log, sizeof(data_node_t *));
+      }
+      out.push_back(node);
+      node = recover_link(&node->next);
+      if (stops->count(node))
+        break;
+    }
+    (*ends)[g] = node;
+  }
+}
+
+// the data nodes of the chain in order, num_threads walk it from the anchor and the skip pointers
+void btree::recover_walk(std::vector<data_node_t *> &nodes, int num_threads)
+{
+  nsTimer clk;
+  clk.start();
+  std::vector<data_node_t *> starts;
+  std::unordered_set<data_node_t *> stops;
+  data_node_t *first = recover_link(&meta->data_anchor);
+  if (first != NULL)
+    starts.push_back(first);
+  pm_skip_table_t *table = meta->skip.get();
+  for (int s = 0; first != NULL && s < SKIP_SLOTS; s++)
+  {
+    data_node_t *node = table->node[s];
+    while (node != NULL && node->log != NULL && node->log_synced())
+      node = node->log_node();
+    if (node != NULL && node != first && stops.insert(node).second)
+      starts.push_back(node);
+  }
+
+  // a skip pointer that is not in the chain anymore only costs its walk
+  std::vector<std::vector<data_node_t *>> groups(starts.size());
+  std::vector<data_node_t *> ends(starts.size(), NULL);
+  size_t next = 0;
+  std::vector<std::thread> workers;
+  for (int t = 1; t < num_threads; t++)
+    workers.push_back(std::thread(&btree::recover_walk_groups, this, &starts, &stops, &groups, &ends, &next));
+  recover_walk_groups(&starts, &stops, &groups, &ends, &next);
+  for (size_t t = 0; t < workers.size(); t++)
+    workers[t].join();
+
+  // join the groups in chain order from the anchor
+  std::unordered_map<data_node_t *, size_t> group_of;
+  for (size_t g = 0; g < starts.size(); g++)
+    group_of[starts[g]] = g;
+  for (size_t g = 0; !starts.empty();)
+  {
+    nodes.insert(nodes.end(), groups[g].begin(), groups[g].end());
+    if (ends[g] == NULL)
+      break;
+    g = group_of[ends[g]];
+  }
+  recover_walk_ns = clk.end();
+  recover_groups = starts.size();
+}
+
+// rebuild the DRAM part of a tree from the pool it was created in
+btree *btree::recover(char *pool, int num_threads)
+{
+  if (!pm_heap.open(pool))
+    return NULL;
+  pm_superblock_t *meta = (pm_superblock_t *)pm_heap.root();
+  if (meta == NULL || meta->magic != POOL_MAGIC || meta->version != POOL_VERSION)
+    return NULL;
+  btree *bt = new btree(meta);
+
+  // 1. walk the data node chain, only the line holding next and log is read
+  std::vector<data_node_t *> nodes;
+  if (num_threads < 1)
+    num_threads = 1;
+  bt->recover_walk(nodes, num_threads);
+
+  // the allocator keeps what is still reachable, the workers mark the live nodes
+  pm_heap.gc_begin();
+  pm_heap.gc_mark(meta);
+  pm_heap.gc_mark(meta->skip.get());
+
+  // 2. rebuild the leaves of contiguous ranges of the chain in parallel
+  size_t n = nodes.size();
+  leaf_node_t *leaves = (leaf_node_t *)dram_arena.alloc(n * sizeof(leaf_node_t));
+  std::vector<uint8_t> live(n, 0);
+  std::vector<std::thread> workers;
+  for (int t = 1; t < num_threads; t++)
+    workers.push_back(std::thread(&btree::recover_leaves, bt, nodes.data(), leaves, live.data(),
+                                  n * t / num_threads, n * (t + 1) / num_threads));
+  bt->recover_leaves(nodes.data(), leaves, live.data(), 0, n / num_threads);
+  for (size_t t = 0; t < workers.size(); t++)
+    workers[t].join();
+
+  // 3. link the leaves and unlink the empty nodes
+  std::vector<page *> inner_children;
+  std::vector<entry_key_t> low_keys;
+  leaf_node_t *prev = NULL;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (!live[i])
+    {
+      prev->data->next = nodes[i]->next;
+      pm_persist(&prev->data->next, sizeof(data_node_t *));
+      continue;
+    }
+    leaf_node_t *leaf = &leaves[i];
+    if (prev != NULL)
+    {
+      prev->high_key = leaf->low_key;
+      prev->next = leaf;
+    }
+    prev = leaf;
+    mem_stats_t *st = my_mem_stats();
+    st->leaves++;
+    st->data_nodes++;
+    st->keys += __builtin_popcountll(leaf->bitmap);
+    inner_children.push_back((page *)leaf);
+    low_keys.push_back(leaf->low_key);
+  }
+
+  // 4. rebuild the inner nodes, leave room for inserts; the skip pointers only name live nodes before the
+  //    allocator frees the others
+  bt->anchor = &leaves[0];
+  bt->skip_build(inner_children);
+  bt->build_inner_levels(inner_children, low_keys, 1, 0.7);
+  pm_heap.gc_end();
+
+  // the pool is in use until the next shutdown
+  meta->clean = 0;
+  pm_persist(&meta->clean, sizeof(uint64_t));
+  return bt;
+}
+
+// all threads have stopped, mark the pool as cleanly closed
+void btree::shutdown()
+{
+  asm_mfence();
+  meta->clean = 1;
+  pm_persist(&meta->clean, sizeof(uint64_t));
+}
+
+// bulk load worker, the data nodes of leaves[begin, end); bulk_fill_leaves writes them whole
+void btree::bulk_alloc_leaves(leaf_node_t *leaves, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; i++)
+    leaves[i].data = (data_node_t *)data_alloc(sizeof(data_node_t), false);
+}
+
+// bulk load worker, fills leaves[begin, end) with per_leaf entries each
+template <class Iter>
+void btree::bulk_fill_leaves(Iter first, size_t n, int per_leaf, leaf_node_t *leaves, size_t num_leaves, size_t begin, size_t end)
+{
+  // every data node is built in DRAM and streamed to PM in whole lines
+  alignas(64) char image[sizeof(data_node_t)];
+  data_node_t *node = (data_node_t *)image;
+  for (size_t i = begin; i < end; i++)
+  {
+    leaf_node_t *leaf = &leaves[i];
+    size_t base = i * per_leaf;
+    int cnt = (int)std::min((size_t)per_leaf, n - base);
+    Iter it = first + base;
+    memset(image, 0, sizeof(image));
+    for (int j = 0; j < cnt; j++, ++it)
+    {
+      node->kv[j].key = (*it).first;
+      node->kv[j].ptr = (char *)(*it).second;
+      leaf->finger_prints[j] = hashfunc(node->kv[j].key);
+    }
+    node->next = (i + 1 < num_leaves) ? leaves[i + 1].data : NULL;
+    nt_copy(leaf->data, image, sizeof(data_node_t));
+
+    leaf->bitmap = (cnt == 64) ? (~0llu) : ((1llu << cnt) - 1);
+    leaf->number = cnt;
+    leaf->claimed = leaf->bitmap;
+    leaf->low_key = (i == 0) ? 0 : short_separator((*(first + base - 1)).first, node->kv[0].key);
+    leaf->high_key = (i + 1 < num_leaves) ? short_separator((*(first + base + per_leaf - 1)).first, (*(first + base + per_leaf)).first) : (~0llu);
+    leaf->next = (i + 1 < num_leaves) ? &leaves[i + 1] : NULL;
+  }
+  asm_sfence();
+}
+
+// build an empty tree from [first, last) sorted by key without duplicates, *it is a (key, value) pair
+// leaves get fill_factor of their slots, the inner nodes as much of theirs; num_threads load key ranges in parallel
+template <class Iter>
+bool btree::bulk_load(Iter first, Iter last, float fill_factor, int num_threads)
+{
+  if (height != 1 || anchor->number != 0)
+  {
+    printf("[NVM MGR]	bulk load needs an empty tree\n");
+    return false;
+  }
+  size_t n = last - first;
+  if (n == 0)
+    return true;
+  int per_leaf = std::max(1, std::min(LEAF_NODE_SIZE, (int)(LEAF_NODE_SIZE * fill_factor)));
+  size_t num_leaves = (n + per_leaf - 1) / per_leaf;
+  leaf_node_t *leaves = (leaf_node_t *)dram_arena.alloc(num_leaves * sizeof(leaf_node_t));
+  if (num_threads < 1)
+    num_threads = 1;
+
+  // 1. allocate the data nodes, a leaf links to the data node of the next one
+  std::vector<std::thread> workers;
+  for (int t = 1; t < num_threads; t++)
+    workers.push_back(std::thread(&btree::bulk_alloc_leaves, this, leaves,
+                                  num_leaves * t / num_threads, num_leaves * (t + 1) / num_threads));
+  bulk_alloc_leaves(leaves, 0, num_leaves / num_threads);
+  for (size_t t = 0; t < workers.size(); t++)
+    workers[t].join();
+  workers.clear();
+
+  // 2. fill the data nodes and leaves of contiguous key ranges
+  for (int t = 1; t < num_threads; t++)
+    workers.push_back(std::thread(&btree::bulk_fill_leaves<Iter>, this, first, n, per_leaf, leaves, num_leaves,
+                                  num_leaves * t / num_threads, num_leaves * (t + 1) / num_threads));
+  bulk_fill_leaves(first, n, per_leaf, leaves, num_leaves, 0, num_leaves / num_threads);
+  for (size_t t = 0; t < workers.size(); t++)
+    workers[t].join();
+
+  // 3. build the inner nodes bottom-up
+  std::vector<page *> inner_children(num_leaves);
+  std::vector<entry_key_t> low_keys(num_leaves);
+  for (size_t i = 0; i < num_leaves; i++)
+  {
+    inner_children[i] = (page *)&leaves[i];
+    low_keys[i] = leaves[i].low_key;
+  }
+  std::vector<page *> inner_leaves(inner_children);
+  build_inner_levels(inner_children, low_keys, 1, fill_factor);
+  my_mem_stats()->leaves += num_leaves;
+  my_mem_stats()->keys += n;
+
+  // 4. publish the new chain, the empty leaf it replaces is not reachable anymore
+  leaf_node_t *old = anchor;
+  anchor = &leaves[0];
+  meta->data_anchor = anchor->data;
+  pm_persist(&meta->data_anchor, sizeof(data_node_t *));
+  skip_build(inner_leaves);
+  retire_leaf(old);
+  return true;
+}
+
 // store the key into the node at the given level
-void btree::btree_insert_internal(char *left, entry_key_t key, char *right, uint32_t level, leaf_node_t *leaf)
+// child is the locked node that split, store unlocks it
+void btree::btree_insert_internal(char *left, entry_key_t key, char *right, uint32_t level, leaf_node_t *leaf, inner_node_t *child)
 {
   if (level > ((inner_node_t *)root)->hdr.level)
+  {
+    if (child)
+      child->write_unlock();
     return;
+  }
 
   inner_node_t *p = (inner_node_t *)(this->root);
 
   while (p->hdr.level > level)
     p = (inner_node_t *)p->linear_search(key);
 
-  p->store(this, left, key, right, true, true, NULL, leaf);
+  p->store(this, left, key, right, true, true, NULL, leaf, child);
 }
 
 // find the leaf
@@ -1132,34 +2322,76 @@ leaf_node_t *btree::inner_node_search(entry_key_t key, char **prev, inner_node_t
   return leaf;
 }
 
-int btree::find_item(entry_key_t key, leaf_node_t *leaf, uint8_t hash)
+// a leaf of the thread's cache whose fences hold key, NULL if there is none
+leaf_node_t *btree::cached_leaf(entry_key_t key)
 {
-  for (int i = 0; i < leaf->number; ++i)
+  if (leaf_cache_size == 0)
+    return NULL;
+  leaf_cache_t *c = my_leaf_cache();
+  uint64_t e = epoch_mgr.entered();
+  if (c->tree != this || c->epoch != e)
   {
-    if (leaf->finger_prints[i] == hash)
+    // the leaves may have been freed since
+    c->tree = this;
+    c->epoch = e;
+    c->n = 0;
+  }
+  for (int i = 0; i < c->n; i++)
+  {
+    leaf_node_t *leaf = c->leaves[i];
+    if (leaf->check_split())
     {
-      if (leaf->data->kv[i].key == key)
-      {
-        return i;
-      }
+      // its split replaces it, the new leaves are reached through the tree
+      c->leaves[i--] = c->leaves[--c->n];
+      continue;
+    }
+    if (key >= leaf->low_key && key < leaf->high_key)
+    {
+      for (; i > 0; i--)
+        c->leaves[i] = c->leaves[i - 1];
+      c->leaves[0] = leaf;
+      c->hits++;
+      return leaf;
     }
   }
-  return -1;
+  c->misses++;
+  return NULL;
 }
 
-unsigned char btree::hashfunc(uint64_t val)
+// remember leaf, it has been reached in the running operation
+void btree::cache_leaf(leaf_node_t *leaf)
 {
-  unsigned char hash = 123;
-  int i;
-  for (i = 0; i < sizeof(uint64_t); i++)
-  {
-    uint64_t octet = val & 0x00ff;
-    val = val >> 8;
+  if (leaf_cache_size == 0 || leaf == NULL)
+    return;
+  leaf_cache_t *c = my_leaf_cache();
+  if (c->tree != this || c->epoch != epoch_mgr.entered() || (c->n > 0 && c->leaves[0] == leaf) || leaf->check_split())
+    return;
+  int n = std::min(c->n, std::min(leaf_cache_size, LEAF_CACHE_MAX) - 1);
+  for (int i = n; i > 0; i--)
+    c->leaves[i] = c->leaves[i - 1];
+  c->leaves[0] = leaf;
+  c->n = n + 1;
+}
 
-    hash = hash ^ octet;
-    hash = hash * kFNVPrime64;
+leaf_node_t *btree::find_cached_leaf(entry_key_t key)
+{
+  leaf_node_t *leaf = cached_leaf(key);
+  if (leaf == NULL)
+  {
+    leaf = inner_node_search(key);
+    cache_leaf(leaf);
   }
-  return hash;
+  return leaf;
+}
+
+int btree::find_item(entry_key_t key, leaf_node_t *leaf, uint8_t hash)
+{
+  return leaf->find_item(key, hash);
+}
+
+unsigned char btree::hashfunc(uint64_t val)
+{
+  return fp_hash_t::hash(val);
 }
 
 leaf_node_t *btree::SplitLeaf(leaf_node_t *leaf, inner_node_t *parent, leaf_node_t *prev = NULL, entry_key_t key = 0, bool debug = false, int id = 0)
@@ -1167,8 +2399,27 @@ leaf_node_t *btree::SplitLeaf(leaf_node_t *leaf, inner_node_t *parent, leaf_node
   entry_key_t split_key;
   leaf_node_t *firleaf, *secleaf;
 
+  // 0. a merged pair is finished by the thread that froze it, it holds their parent
+  leaf->wait_frozen();
+  if (leaf->merge_next != NULL || leaf->merge_prev != NULL)
+  {
+    leaf_node_t *left = (leaf->merge_prev != NULL) ? leaf->merge_prev : leaf;
+    merge_sync(left);
+    for (int spins = 1; !left->fin_flag; spins++)
+    {
+      if (spins % 64 == 0)
+        sched_yield();
+      else
+        asm("pause");
+    }
+    return left->log;
+  }
+
   // 1. copy the entry from old leaf to new leaf
-  copy(leaf);
+  nsTimer clk;
+  clk.start();
+  bool copied = copy(leaf);
+  uint64_t copy_ns = copied ? clk.end() : 0;
 
   // 2. sync the update/delete happened in copy phase
   sync(leaf);
@@ -1179,12 +2430,35 @@ leaf_node_t *btree::SplitLeaf(leaf_node_t *leaf, inner_node_t *parent, leaf_node
   // 4. update the parent
   update_parent(leaf, parent);
 
+  if (copied)
+  {
+    split_stats_t *st = my_split_stats();
+    int nodes = (leaf->log->sibling == NULL) ? 1 : 2;
+    st->splits++;
+    st->compactions += (nodes == 1);
+    st->copy_ns += copy_ns;
+    st->split_ns += clk.end();
+    st->pm_bytes += nodes * sizeof(data_node_t);
+    // cached stores fetch every line of the new nodes, zeroing them in data_alloc or filling them
+    if (!split_nt_copy)
+      st->rfo_bytes += nodes * sizeof(data_node_t);
+  }
+
+  // 5. no new operation can reach the old leaf, free it once the running ones are done
+  if (leaf->prev_flag && leaf->fin_flag && __sync_bool_compare_and_swap(&leaf->retired, false, true))
+  {
+    skip_move(leaf);
+    if (__sync_add_and_fetch(&skip_splits, 1) % SKIP_EVERY == 0)
+      skip_add(leaf->log);
+    retire_leaf(leaf);
+  }
+
   leaf_node_t *inserted_leaf = leaf->log;
   if (key != 0)
   {
     if (key >= inserted_leaf->high_key)
     {
-      inserted_leaf = (leaf_node_t *)(inserted_leaf->next);
+      inserted_leaf = inserted_leaf->sibling;
     }
   }
   return inserted_leaf;
@@ -1218,33 +2492,57 @@ bool btree::check_parent(char *left, entry_key_t key, char *right, uint32_t leve
     return false;
 }
 
-void btree::copy(leaf_node_t *leaf)
+// false if another thread has committed its copy of the leaf
+bool btree::copy(leaf_node_t *leaf)
 {
   if (leaf->log != NULL)
-    return;
+    return false;
 
   // 1. find split key
   int count = 0;
   entry_key_t keys[LEAF_NODE_SIZE];
   entry_key_t splitKey;
+  uint64_t valid = leaf->wait_frozen();
   for (int i = 0; i < LEAF_NODE_SIZE; i++)
   {
     keys[count] = leaf->data->kv[i].key;
-    if (keys[count] != 0 && leaf->check_slot(i))
+    if (keys[count] != 0 && (valid & (1llu << i)))
       count++;
   }
-  std::sort(keys, keys + count);
-  splitKey = keys[count / 2];
+  // a leaf that mostly holds deleted slots is compacted: every entry goes to one new leaf with the same range
+  bool compact = count < leaf_compact_ratio * LEAF_NODE_SIZE;
+  if (compact)
+    splitKey = leaf->high_key;
+  else
+  {
+    std::sort(keys, keys + count);
+    splitKey = (count > 1) ? short_separator(keys[count / 2 - 1], keys[count / 2]) : keys[count / 2];
+  }
 
   // 2. alllocate leaf and data
   leaf_node_t *firleaf = (leaf_node_t *)leaf_alloc(sizeof(leaf_node_t));
-  leaf_node_t *secleaf = (leaf_node_t *)leaf_alloc(sizeof(leaf_node_t));
-  data_node_t *firdata = (data_node_t *)data_alloc(sizeof(data_node_t));
-  data_node_t *secdata = (data_node_t *)data_alloc(sizeof(data_node_t));
+  leaf_node_t *secleaf = compact ? NULL : (leaf_node_t *)leaf_alloc(sizeof(leaf_node_t));
+  data_node_t *firdata = (data_node_t *)data_alloc(sizeof(data_node_t), !split_nt_copy);
+  data_node_t *secdata = compact ? NULL : (data_node_t *)data_alloc(sizeof(data_node_t), !split_nt_copy);
   firleaf->data = firdata;
-  secleaf->data = secdata;
-
-  // 3. copy the entry to the new leaf
+  if (!compact)
+    secleaf->data = secdata;
+
+  // 3. copy the entry to the new leaf, the data nodes are staged in DRAM and written to PM
+  //    in whole lines, without reading the lines for ownership first
+  alignas(64) char image[2][sizeof(data_node_t)];
+  data_node_t *out[2];
+  if (split_nt_copy)
+  {
+    memset(image, 0, sizeof(image));
+    out[0] = (data_node_t *)image[0];
+    out[1] = (data_node_t *)image[1];
+  }
+  else
+  {
+    out[0] = firdata;
+    out[1] = secdata;
+  }
   entry_key_t key;
   uint64_t value;
   leaf_node_t *node[2];
@@ -1256,7 +2554,7 @@ void btree::copy(leaf_node_t *leaf)
   for (int i = 0; i < LEAF_NODE_SIZE; i++)
   {
     key = leaf->data->kv[i].key;
-    if (key != 0 && leaf->check_slot(i))
+    if (key != 0 && (valid & (1llu << i)))
     {
       if (key >= splitKey)
         c = 1;
@@ -1265,104 +2563,126 @@ void btree::copy(leaf_node_t *leaf)
       value = uint64_t(leaf->data->kv[i].ptr);
       value |= MASK;
       node[c]->finger_prints[len[c]] = leaf->finger_prints[i];
-      node[c]->data->kv[len[c]].key = leaf->data->kv[i].key;
-      node[c]->data->kv[len[c]].ptr = (char *)value;
+      out[c]->kv[len[c]].key = leaf->data->kv[i].key;
+      out[c]->kv[len[c]].ptr = (char *)value;
       len[c]++;
     }
   }
 
-  // 4. set the infomation
+  // 4. set the infomation, a compacted leaf has no sibling and takes the place of the old one in the chain
+  firleaf->copied = len[0];
+  firleaf->sibling = secleaf;
   firleaf->number = len[0];
-  firleaf->bitmap = (1llu << len[0]) - 1;
-  secleaf->number = len[1];
-  secleaf->bitmap = (1llu << len[1]) - 1;
+  firleaf->bitmap = firleaf->claimed = (1llu << len[0]) - 1;
   firleaf->high_key = splitKey;
-  secleaf->high_key = leaf->high_key;
   firleaf->low_key = leaf->low_key;
-  secleaf->low_key = splitKey;
-  firleaf->next = secleaf;
-  secleaf->next = leaf->next;
-  firleaf->data->next = secleaf->data;
-  secleaf->data->next = leaf->data->next;
+  out[0]->log = NULL;
+  if (compact)
+  {
+    firleaf->next = leaf->next;
+    out[0]->next = leaf->data->next;
+  }
+  else
+  {
+    secleaf->copied = len[1];
+    secleaf->number = len[1];
+    secleaf->bitmap = secleaf->claimed = (1llu << len[1]) - 1;
+    secleaf->high_key = leaf->high_key;
+    secleaf->low_key = splitKey;
+    firleaf->next = secleaf;
+    secleaf->next = leaf->next;
+    out[0]->next = secdata;
+    out[1]->next = leaf->data->next;
+    out[1]->log = NULL;
+  }
+  if (split_nt_copy)
+  {
+    // non-temporal stores are durable in ADR too once the sfence retires
+    nt_copy(firdata, image[0], sizeof(data_node_t));
+    if (!compact)
+      nt_copy(secdata, image[1], sizeof(data_node_t));
+    asm_sfence();
+  }
+  else
+  {
+    pm_writeback(firdata, sizeof(data_node_t));
+    if (!compact)
+      pm_writeback(secdata, sizeof(data_node_t));
+    pm_drain();
+  }
 
   // 5. commit copy
-  __sync_bool_compare_and_swap(&(leaf->log), NULL, firleaf);
+  bool won = __sync_bool_compare_and_swap(&(leaf->log), NULL, firleaf);
+  if (!won)
+  {
+    drop_leaf(firleaf);
+    if (!compact)
+      drop_leaf(secleaf);
+  }
   leaf->data->log = leaf->log->data;
+  pm_persist(&leaf->data->log, sizeof(data_node_t *));
+  return won;
+}
+
+// bring entry j the copy wrote into node up to date with its source slot in leaf
+void btree::sync_entry(leaf_node_t *leaf, uint64_t valid, data_node_t *node, int j)
+{
+  uint64_t key = node->kv[j].key;
+  if (key == 0)
+    return;
+  // find the source slot of the copy
+  int i;
+  for (i = 0; i < LEAF_NODE_SIZE; i++)
+  {
+    if ((valid & (1llu << i)) && leaf->data->kv[i].key == key)
+      break;
+  }
+  if (i == LEAF_NODE_SIZE)
+  {
+    // A thread delete the key in old leaf and not sync yet
+    __sync_bool_compare_and_swap(&node->kv[j].key, key, 0);
+    return;
+  }
+  // If the value mismatch and has not sync yet: do synchrozing
+  uint64_t value = uint64_t(leaf->data->kv[i].ptr) & (~MASK);
+  uint64_t v = uint64_t(node->kv[j].ptr);
+  if ((v & (COPY_MASK)) != 0 && (v & (~MASK)) != value)
+    __sync_val_compare_and_swap(&node->kv[j].ptr, v, (char *)(value | SYNC_MASK));
 }
 
 void btree::sync(leaf_node_t *leaf)
 {
   if (leaf->sync_flag)
     return;
-  uint64_t key, value;
-  data_node_t *oldnode = leaf->data;
+  if (leaf->merge_next != NULL || leaf->merge_prev != NULL)
+  {
+    merge_sync(leaf->merge_prev != NULL ? leaf->merge_prev : leaf);
+    return;
+  }
   if (leaf->log == NULL)
   {
     leaf->print_node();
     leaf->data->log->print_node();
     assert(false);
   }
-  entry_key_t split_key = leaf->log->high_key;
-  data_node_t *node[2];
-  int len[2];
-  int idx[2];
-  int c;
-  node[0] = leaf->log->data;
-  node[1] = node[0]->next;
-  len[0] = leaf->log->number;
-  len[1] = leaf->log->next->number;
-  idx[0] = idx[1] = 0;
+  // only the entries copy wrote are synced, later inserts into the new leaves are left alone
+  leaf_node_t *new_leaf[2];
+  new_leaf[0] = leaf->log;
+  new_leaf[1] = leaf->log->sibling;
+  uint64_t valid = leaf->wait_frozen();
 
-  for (int i = 0; i < LEAF_NODE_SIZE; i++)
+  for (int c = 0; c < 2 && new_leaf[c] != NULL; c++)
   {
-    uint64_t key = leaf->data->kv[i].key;
-    if (key != 0 && leaf->check_slot(i))
-    {
-      if (key < split_key)
-        c = 0;
-      else
-        c = 1;
-      while (idx[c] < len[c])
-      {
-        // Find the first Valid key-value
-        if (!node[c]->kv[idx[c]].key)
-          break;
-        idx[c]++;
-      }
-      // If syncLeaf has Valid key-value
-      if (idx[c] < len[c])
-      {
-        if (node[c]->kv[idx[c]].key == key) // Match the key
-        {
-          // printf("match!\n");
-          // If the value mismatch and has not sync yet: do synchrozing
-          value = uint64_t(leaf->data->kv[i].ptr) & (~MASK);
-          uint64_t v = uint64_t(node[c]->kv[idx[c]].ptr);
-          if ((v & (COPY_MASK)) != 0 && (v & (~MASK)) != value)
-            __sync_val_compare_and_swap(&node[c]->kv[idx[c]].ptr, v, (char *)(value | SYNC_MASK));
-          // Move to next candidate
-          idx[c]++;
-        }
-        else // Mismatch
-        {
-          // A thread delete the key in old leaf and not sync yet
-          // A thread Insert the key before split begin and not sync yet (already filtered by bitmap)
-          // printf("delete!\n");
-          if (leaf->sync_flag)
-            return;
-          if (leaf->data->kv[i].key) // The key is not deleted
-            // Sync the delete and move to next candidate
-            node[c]->kv[idx[c]++].key = 0;
-        }
-      }
-    }
+    data_node_t *node = new_leaf[c]->data;
+    for (int j = 0; j < new_leaf[c]->copied; j++)
+      sync_entry(leaf, valid, node, j);
+    // copy persisted the rest of the node
+    pm_writeback(node->kv, new_leaf[c]->copied * sizeof(entry));
   }
-  // A thread delete the last few keys in old leaf
-  // Delete it
-  for (int i = idx[0]; i < len[0]; i++)
-    node[0]->kv[i].key = 0;
-  for (int i = idx[1]; i < len[1]; i++)
-    node[1]->kv[i].key = 0;
+  pm_drain();
+  // tell recovery the new nodes are complete, from now on they may get writes of their own
+  leaf->data->log.set_raw(pm_ptr<data_node_t>::to_off(leaf->log->data) | LOG_SYNCED);
+  pm_persist(&leaf->data->log, sizeof(data_node_t *));
   leaf->sync_flag = true;
   asm_mfence();
 }
@@ -1371,7 +2691,8 @@ void btree::update_prev_node(leaf_node_t *leaf, inner_node_t *parent, leaf_node_
 {
   if (leaf->prev_flag)
     return;
-  entry_key_t key = leaf->log->high_key;
+  // a key of the old leaf's range, the new first leaf ends where the old one did after a compaction
+  entry_key_t key = (leaf->log->sibling == NULL) ? leaf->low_key : leaf->log->high_key;
   // leaf_node_t *prev;
   leaf_node_t *next = leaf->log;
   int pre_error = 0;
@@ -1408,12 +2729,14 @@ void btree::update_prev_node(leaf_node_t *leaf, inner_node_t *parent, leaf_node_
     if (prev == NULL)
     {
       // first update the data pointer, then update the meta data pointer
-      __sync_val_compare_and_swap(&data_anchor, leaf->data, next->data);
+      meta->data_anchor.cas(leaf->data, next->data);
+      pm_persist(&meta->data_anchor, sizeof(data_node_t *));
       __sync_val_compare_and_swap(&anchor, leaf, next);
     }
     else
     {
-      __sync_val_compare_and_swap(&prev->data->next, leaf->data, next->data);
+      prev->data->next.cas(leaf->data, next->data);
+      pm_persist(&prev->data->next, sizeof(data_node_t *));
       __sync_val_compare_and_swap(&prev->next, leaf, next);
       // 4. help the previous leaf complete SMO
       if (!leaf->prev_flag)
@@ -1445,6 +2768,11 @@ void btree::update_parent(leaf_node_t *leaf, inner_node_t *parent)
   if (leaf->fin_flag)
     return;
   leaf_node_t *firleaf = leaf->log;
+  if (firleaf->sibling == NULL)
+  {
+    replace_leaf(leaf, parent);
+    return;
+  }
   leaf_node_t *secleaf = (leaf_node_t *)(firleaf->next);
   entry_key_t splitKey = leaf->log->high_key;
   // Set a new root or insert the split key to the parent
@@ -1459,14 +2787,360 @@ void btree::update_parent(leaf_node_t *leaf, inner_node_t *parent)
     btree_insert_internal((char *)firleaf, splitKey, (char *)secleaf, 1, leaf);
 }
 
+// swing the parent pointer of a compacted leaf to the leaf that replaced it
+void btree::replace_leaf(leaf_node_t *leaf, inner_node_t *parent)
+{
+  if (height == 1)
+  {
+    htm_lock l;
+    l.acquire(mtx);
+    if (!leaf->fin_flag)
+    {
+      root = (char *)leaf->log;
+      leaf->fin_flag = 1;
+    }
+    l.release();
+    return;
+  }
+  entry_key_t key = leaf->low_key;
+  inner_node_t *p = parent;
+  if (p == NULL || key < p->hdr.low_key || key >= p->hdr.high_key)
+  {
+    p = (inner_node_t *)root;
+    while (p->hdr.level > 1)
+      p = (inner_node_t *)p->linear_search(key);
+  }
+  p->replace_child(key, leaf, leaf->log, leaf);
+}
+
+// the live entries of leaf dropped below leaf_merge_ratio: merge it with its left or right neighbour
+// under the same level 1 node. The node stays locked for the whole merge, so the leaf before the pair
+// and the records of both leaves stay where they are; threads that find the pair frozen wait for it.
+// A pair that starts at child 0 also locks the level 1 node before, which holds the leaf before the pair
+void btree::merge_leaf(leaf_node_t *leaf, entry_key_t key)
+{
+  if (height == 1)
+    return;
+  inner_node_t *p = (inner_node_t *)root;
+  while (p->hdr.level > 1)
+    p = (inner_node_t *)p->linear_search(key);
+  p->write_lock(false);
+  if ((p->hdr.version & VERSION_OBSOLETE) || key < p->hdr.low_key || key >= p->hdr.high_key)
+  {
+    p->write_unlock();
+    return;
+  }
+
+  // 1. pick the pair (l, l + 1) with the emptier neighbour
+  int n = p->count();
+  int j = -1, l = -1;
+  for (int i = 0; i <= n; i++)
+  {
+    if (p->child(i) == (page *)leaf)
+    {
+      j = i;
+      break;
+    }
+  }
+  if (j >= 0 && j < n)
+    l = j;
+  if (j >= 1 && (l < 0 || ((leaf_node_t *)p->child(j - 1))->live() < ((leaf_node_t *)p->child(j + 1))->live()))
+    l = j - 1;
+  // the merged leaf is at most twice as full as the leaves that start a merge
+  int fit = std::min((int)(2 * leaf_merge_ratio * LEAF_NODE_SIZE), LEAF_NODE_SIZE);
+  leaf_node_t *prev = NULL, *left = NULL, *right = NULL;
+  inner_node_t *q = NULL;
+  bool linked = true;
+  if (l >= 0)
+  {
+    left = (leaf_node_t *)p->child(l);
+    right = (leaf_node_t *)p->child(l + 1);
+    if (l >= 1)
+      prev = (leaf_node_t *)p->child(l - 1);
+    else if (p->hdr.pred_ptr != NULL)
+    {
+      // the last child of the node before, its lock goes against the left to right order: only try it
+      q = p->hdr.pred_ptr;
+      if (!q->try_write_lock())
+        q = NULL;
+      linked = q != NULL && !(q->hdr.version & VERSION_OBSOLETE) && q->hdr.sibling_ptr == p &&
+               (prev = (leaf_node_t *)q->child(q->count()))->next == left;
+    }
+    else
+      linked = anchor == left; // the first leaf, the anchor links to it
+  }
+  if (l < 0 || !linked || left->next != right || left->check_split() || right->check_split() ||
+      left->live() + right->live() > fit || !left->try_split_bit())
+  {
+    // the neighbours may split or empty meanwhile, try again after a few more removes
+    if (j >= 0)
+      leaf->merge_retry = leaf->deleted + MERGE_RETRY_REMOVES;
+    if (q != NULL)
+      q->write_unlock();
+    p->write_unlock();
+    return;
+  }
+
+  // 2. freeze both leaves, the merge pointers are in place before the snapshots are published
+  uint64_t lvalid = __atomic_load_n(&left->bitmap, __ATOMIC_SEQ_CST) & FULL;
+  if (!right->try_split_bit())
+  {
+    left->freeze(lvalid);
+    if (q != NULL)
+      q->write_unlock();
+    p->write_unlock();
+    SplitLeaf(left, p);
+    return;
+  }
+  uint64_t rvalid = __atomic_load_n(&right->bitmap, __ATOMIC_SEQ_CST) & FULL;
+  if (left->count_live(lvalid) + right->count_live(rvalid) > fit)
+  {
+    // the estimate was off, compact them on their own
+    left->freeze(lvalid);
+    right->freeze(rvalid);
+    if (q != NULL)
+      q->write_unlock();
+    p->write_unlock();
+    SplitLeaf(left, p);
+    SplitLeaf(right, p);
+    return;
+  }
+  left->merge_next = right;
+  right->merge_prev = left;
+  right->freeze(rvalid);
+  left->freeze(lvalid);
+
+  // 3. copy both into one leaf and sync it
+  merge_copy(left);
+  merge_sync(left);
+
+  // 4. the leaf before the pair
+  link_merged(prev, left);
+  if (q != NULL)
+    q->write_unlock();
+
+  // 5. the parent, the merged leaf takes the place of the left one and the separator of the right one goes
+  if (l == 0)
+    p->hdr.leftmost_ptr = (page *)left->log;
+  else
+    p->set_ptr(l - 1, (char *)left->log);
+  p->remove_key(p->key_at(l));
+  left->prev_flag = right->prev_flag = 1;
+  left->fin_flag = right->fin_flag = 1;
+  split_stats_t *st = my_split_stats();
+  st->merges++;
+  st->pm_bytes += sizeof(data_node_t);
+  if (!split_nt_copy)
+    st->rfo_bytes += sizeof(data_node_t);
+  if (p->count() < p->capacity() / 4)
+    merge_inner(p);
+  else
+    p->write_unlock();
+
+  // 6. no new operation can reach the old leaves
+  left->retired = right->retired = true;
+  asm_mfence();
+  skip_move(left);
+  skip_move(right);
+  retire_leaf(left);
+  retire_leaf(right);
+}
+
+// copy the live entries of a frozen pair into one new leaf; false if another thread has committed its copy
+bool btree::merge_copy(leaf_node_t *left)
+{
+  if (left->log != NULL)
+    return false;
+  leaf_node_t *right = left->merge_next;
+  bool won = false;
+  if (right->log == NULL)
+  {
+    leaf_node_t *src[2] = {left, right};
+    uint64_t valid[2] = {left->wait_frozen(), right->wait_frozen()};
+    leaf_node_t *merged = (leaf_node_t *)leaf_alloc(sizeof(leaf_node_t));
+    data_node_t *data = (data_node_t *)data_alloc(sizeof(data_node_t), !split_nt_copy);
+    merged->data = data;
+    alignas(64) char image[sizeof(data_node_t)];
+    data_node_t *out = data;
+    if (split_nt_copy)
+    {
+      memset(image, 0, sizeof(image));
+      out = (data_node_t *)image;
+    }
+    int len = 0;
+    for (int s = 0; s < 2; s++)
+    {
+      for (int i = 0; i < LEAF_NODE_SIZE; i++)
+      {
+        entry_key_t key = src[s]->data->kv[i].key;
+        if (key != 0 && (valid[s] & (1llu << i)))
+        {
+          merged->finger_prints[len] = src[s]->finger_prints[i];
+          out->kv[len].key = key;
+          out->kv[len].ptr = (char *)(uint64_t(src[s]->data->kv[i].ptr) | MASK);
+          len++;
+        }
+      }
+    }
+    merged->copied = len;
+    merged->number = len;
+    merged->bitmap = merged->claimed = (1llu << len) - 1;
+    merged->low_key = left->low_key;
+    merged->high_key = right->high_key;
+    merged->next = right->next;
+    out->next = right->data->next;
+    out->log = NULL;
+    if (split_nt_copy)
+    {
+      nt_copy(data, image, sizeof(data_node_t));
+      asm_sfence();
+    }
+    else
+    {
+      pm_writeback(data, sizeof(data_node_t));
+      pm_drain();
+    }
+    won = __sync_bool_compare_and_swap(&right->log, NULL, merged);
+    if (!won)
+      drop_leaf(merged);
+  }
+
+  // commit the copy in the right leaf first, the left one takes the same leaf
+  right->data->log.cas(NULL, right->log->data);
+  pm_persist(&right->data->log, sizeof(data_node_t *));
+  __sync_bool_compare_and_swap(&left->log, NULL, right->log);
+  left->data->log.cas(NULL, left->log->data);
+  pm_persist(&left->data->log, sizeof(data_node_t *));
+  return won;
+}
+
+void btree::merge_sync(leaf_node_t *left)
+{
+  if (left->sync_flag)
+    return;
+  leaf_node_t *right = left->merge_next;
+  if (left->log == NULL)
+    merge_copy(left);
+  leaf_node_t *merged = left->log;
+  data_node_t *node = merged->data;
+  uint64_t lvalid = left->wait_frozen();
+  uint64_t rvalid = right->wait_frozen();
+  for (int j = 0; j < merged->copied; j++)
+  {
+    if (node->kv[j].key < left->high_key)
+      sync_entry(left, lvalid, node, j);
+    else
+      sync_entry(right, rvalid, node, j);
+  }
+  pm_writeback(node->kv, merged->copied * sizeof(entry));
+  pm_drain();
+  // recovery reaches the right node only through the left one, which is marked first
+  uint64_t synced = pm_ptr<data_node_t>::to_off(node) | LOG_SYNCED;
+  left->data->log.set_raw(synced);
+  pm_persist(&left->data->log, sizeof(data_node_t *));
+  right->data->log.set_raw(synced);
+  pm_persist(&right->data->log, sizeof(data_node_t *));
+  left->sync_flag = right->sync_flag = true;
+  asm_mfence();
+}
+
+// point prev at the merged leaf of left, or the anchor if prev is NULL. The parents of both are locked,
+// prev can only split: the last leaf of the split copied the old next pointer, or gets the new one from the copy
+void btree::link_merged(leaf_node_t *prev, leaf_node_t *left)
+{
+  leaf_node_t *merged = left->log;
+  if (prev == NULL)
+  {
+    // the first leaf, like update_prev_node the data pointer goes before the anchor
+    meta->data_anchor.cas(left->data, merged->data);
+    pm_persist(&meta->data_anchor, sizeof(data_node_t *));
+    __sync_val_compare_and_swap(&anchor, left, merged);
+    asm_mfence();
+    return;
+  }
+  while (true)
+  {
+    prev->data->next.cas(left->data, merged->data);
+    pm_persist(&prev->data->next, sizeof(data_node_t *));
+    __sync_val_compare_and_swap(&prev->next, left, merged);
+    if (!prev->check_split())
+      break;
+    copy(prev);
+    prev = (prev->log->sibling != NULL) ? prev->log->sibling : prev->log;
+  }
+  asm_mfence();
+}
+
+// p is locked and less than a quarter full: take in its right sibling if both have the same parent
+// and fit into half of p, then go on with the parent. Unlocks p; the root is never merged away
+void btree::merge_inner(inner_node_t *p)
+{
+  while (true)
+  {
+    inner_node_t *s = p->hdr.sibling_ptr;
+    inner_node_t *g = (inner_node_t *)root;
+    if (s == NULL || g == p || g->hdr.level <= p->hdr.level)
+    {
+      p->write_unlock();
+      return;
+    }
+    while (g->hdr.level > p->hdr.level + 1)
+      g = (inner_node_t *)g->linear_search(s->hdr.low_key);
+    // left to right on a level, then upwards, the order the splits take the locks in
+    s->write_lock(false);
+    g->write_lock(false);
+    int pn = p->count(), sn = s->count(), gn = g->count();
+    int rec = -1;
+    if (!(s->hdr.version & VERSION_OBSOLETE) && !(g->hdr.version & VERSION_OBSOLETE) && p->hdr.sibling_ptr == s)
+    {
+      for (int i = 0; i < gn; i++)
+      {
+        if (g->ptr_at(i) == (char *)s)
+        {
+          rec = i;
+          break;
+        }
+      }
+    }
+    if (rec < 0 || g->child(rec) != (page *)p || pn + sn + 1 > p->capacity() / 2 ||
+        (p->hdr.compact && !inner_node_t::can_compact(p->hdr.low_key, s->hdr.high_key)))
+    {
+      g->write_unlock();
+      s->write_unlock();
+      p->write_unlock();
+      return;
+    }
+
+    // the separator of s leads to its leftmost child, then come its records
+    p->insert_key(NULL, s->hdr.low_key, (char *)s->hdr.leftmost_ptr, &pn);
+    for (int i = 0; i < sn; i++)
+      p->insert_key(NULL, s->key_at(i), s->ptr_at(i), &pn);
+    p->hdr.high_key = s->hdr.high_key;
+    p->hdr.sibling_ptr = s->hdr.sibling_ptr;
+    if (s->hdr.sibling_ptr != NULL)
+      s->hdr.sibling_ptr->hdr.pred_ptr = p;
+    // readers and writers that still reach s go on to p through its pred_ptr
+    s->hdr.version |= VERSION_OBSOLETE;
+    g->remove_key(g->key_at(rec));
+    s->write_unlock();
+    p->write_unlock();
+    my_mem_stats()->retired_inner++;
+    epoch_mgr.retire(s, free_inner);
+    my_split_stats()->inner_merges++;
+
+    if (g->count() >= g->capacity() / 4)
+    {
+      g->write_unlock();
+      return;
+    }
+    p = g;
+  }
+}
+
 bool btree::modify(leaf_node_t *leaf, int pos, entry_key_t key, char *right)
 {
   leaf->data->kv[pos].ptr = right;
-#ifndef eADR
-  flush_data(&leaf->data->kv[pos].ptr, sizeof(uint64_t));
-#else
-  asm_mfence();
-#endif
+  pm_persist_entry(&leaf->data->kv[pos].ptr, sizeof(uint64_t));
 
   while (leaf->check_split())
   {
@@ -1478,7 +3152,7 @@ bool btree::modify(leaf_node_t *leaf, int pos, entry_key_t key, char *right)
     {
       leaf_node_t *new_leaf = (leaf_node_t *)(leaf->log);
       if (key >= new_leaf->high_key)
-        new_leaf = (leaf_node_t *)(new_leaf->next);
+        new_leaf = new_leaf->sibling;
       assert(key >= new_leaf->low_key);
       assert(key < new_leaf->high_key);
       uint8_t hash = hashfunc(key);
@@ -1504,16 +3178,68 @@ bool btree::modify(leaf_node_t *leaf, int pos, entry_key_t key, char *right)
 
 char *btree::search(entry_key_t key)
 {
+  epoch_guard guard;
   leaf_node_t *leaf;
+
+  leaf = find_cached_leaf(key);
+  return search_leaf(leaf, key, hashfunc(key));
+}
+
+// look up keys[0, n), out[i] is the value of keys[i] or NULL
+void btree::multi_search(entry_key_t *keys, int n, char **out)
+{
+  epoch_guard guard;
+  page *nodes[MULTI_SEARCH_GROUP];
+  uint8_t hash[MULTI_SEARCH_GROUP];
+
+  for (int b = 0; b < n; b += MULTI_SEARCH_GROUP)
+  {
+    int m = std::min(MULTI_SEARCH_GROUP, n - b);
+    entry_key_t *k = keys + b;
+
+    // 1. the lookups of a group go down one level at a time, a node is prefetched a round before it is read
+    page *p = (page *)root;
+    int level = (height > 1) ? ((inner_node_t *)p)->hdr.level : 0;
+    for (int i = 0; i < m; i++)
+      nodes[i] = p;
+    while (level-- > 0)
+    {
+      for (int i = 0; i < m; i++)
+      {
+        nodes[i] = ((inner_node_t *)nodes[i])->linear_search(k[i]);
+        prefetch(nodes[i]);
+        prefetch((char *)nodes[i] + CACHE_LINE_SIZE);
+      }
+    }
+
+    // 2. check the fences like inner_node_search, prefetch the slots of the data nodes
+    for (int i = 0; i < m; i++)
+    {
+      leaf_node_t *leaf = (leaf_node_t *)nodes[i];
+      while (k[i] >= leaf->high_key)
+        leaf = leaf->next;
+      if (k[i] < leaf->low_key)
+        leaf = inner_node_search(k[i]);
+      nodes[i] = leaf;
+      hash[i] = hashfunc(k[i]);
+      leaf->prefetch_item(hash[i]);
+    }
+
+    // 3. read the entries
+    for (int i = 0; i < m; i++)
+      out[b + i] = search_leaf((leaf_node_t *)nodes[i], k[i], hash[i]);
+  }
+}
+
+// the value of key in leaf, a split leaf is read through its new leaves
+char *btree::search_leaf(leaf_node_t *leaf, entry_key_t key, uint8_t hash)
+{
   int pos;
   char *res;
-  bool retry;
 
-  leaf = inner_node_search(key);
   assert(key < leaf->high_key);
   assert(key >= leaf->low_key);
 
-  uint8_t hash = hashfunc(key);
   pos = find_item(key, leaf, hash);
   if (pos == -1)
     res = NULL;
@@ -1532,30 +3258,32 @@ char *btree::search(entry_key_t key)
       leaf_node_t *new_leaf = (leaf_node_t *)(leaf->log);
       char *new_res;
       if (key >= new_leaf->high_key)
-        new_leaf = (leaf_node_t *)(new_leaf->next);
+        new_leaf = new_leaf->sibling;
       assert(key >= new_leaf->low_key);
       assert(key < new_leaf->high_key);
       pos = find_item(key, new_leaf, hash);
       if (pos == -1)
         return NULL;
       if (leaf->sync_flag)
-        return leaf->data->kv[pos].ptr;
+        return new_leaf->data->kv[pos].ptr;
+      if (pos >= new_leaf->copied)
+        return new_leaf->data->kv[pos].ptr;
       if (res == NULL)
       {
         // item delete in old leaf, but appear in new leaf, delete it
-        leaf->data->kv[pos].key = 0;
-        asm_mfence();
+        new_leaf->data->kv[pos].key = 0;
+        pm_persist_entry(&new_leaf->data->kv[pos].key, sizeof(entry_key_t));
         return res;
       }
       else
       {
-        new_res = leaf->data->kv[pos].ptr;
+        new_res = new_leaf->data->kv[pos].ptr;
         if (new_res == res)
           return res;
         else
         {
-          leaf->data->kv[pos].ptr = res;
-          asm_mfence();
+          new_leaf->data->kv[pos].ptr = res;
+          pm_persist_entry(&new_leaf->data->kv[pos].ptr, sizeof(char *));
           return res;
         }
       }
@@ -1566,12 +3294,13 @@ char *btree::search(entry_key_t key)
 
 bool btree::update(entry_key_t key, char *right)
 {
+  epoch_guard guard;
   leaf_node_t *leaf;
   int pos;
   char *res;
   bool retry;
 
-  leaf = inner_node_search(key);
+  leaf = find_cached_leaf(key);
 
   assert(key < leaf->high_key);
   assert(key >= leaf->low_key);
@@ -1581,11 +3310,7 @@ bool btree::update(entry_key_t key, char *right)
   if (pos == -1)
     return false;
   leaf->data->kv[pos].ptr = right;
-#ifndef eADR
-  flush_data(&leaf->data->kv[pos].ptr, sizeof(uint64_t));
-#else
-  asm_mfence();
-#endif
+  pm_persist_entry(&leaf->data->kv[pos].ptr, sizeof(uint64_t));
 
   while (leaf->check_split())
   {
@@ -1597,7 +3322,7 @@ bool btree::update(entry_key_t key, char *right)
     {
       leaf_node_t *new_leaf = (leaf_node_t *)(leaf->log);
       if (key >= new_leaf->high_key)
-        new_leaf = (leaf_node_t *)(new_leaf->next);
+        new_leaf = new_leaf->sibling;
       assert(key >= new_leaf->low_key);
       assert(key < new_leaf->high_key);
       int npos = find_item(key, new_leaf, hash);
@@ -1622,14 +3347,17 @@ bool btree::update(entry_key_t key, char *right)
 
 bool btree::insert(entry_key_t key, char *right)
 {
+  epoch_guard guard;
   leaf_node_t *leaf, *prev = NULL;
-  inner_node_t *parent;
+  inner_node_t *parent = NULL;
   int old_slot;
   uint8_t hash;
-  uint8_t pos;
+  uint32_t pos;
 
-  // 1. Inner node search
-  leaf = inner_node_search(key, (char **)&prev, (inner_node_t **)&parent);
+  // 1. Inner node search, a cached leaf has no prev and parent, a split finds them
+  leaf = cached_leaf(key);
+  if (leaf == NULL)
+    leaf = inner_node_search(key, (char **)&prev, (inner_node_t **)&parent);
   assert(leaf != NULL);
 
   while (true)
@@ -1639,18 +3367,22 @@ bool btree::insert(entry_key_t key, char *right)
     old_slot = find_item(key, leaf, hash);
     if (old_slot >= 0)
     {
+      cache_leaf(leaf);
       return modify(leaf, old_slot, key, right);
     }
 
-    // 3. Test Full
-    if (leaf->number >= LEAF_NODE_SIZE)
+    // 3. Test Full, number has holes below it with xpline_stripe
+    if (!xpline_stripe && leaf->number >= LEAF_NODE_SIZE)
     {
       leaf->set_split_bit();
       leaf = SplitLeaf(leaf, parent, prev, key);
       continue;
     }
     // 4. Allocate the pos
-    pos = __sync_fetch_and_add(&leaf->number, 1);
+    if (xpline_stripe)
+      pos = (uint32_t)leaf->claim_slot(my_leaf_stripe());
+    else
+      pos = __sync_fetch_and_add(&leaf->number, 1);
 
     if (pos > (LEAF_NODE_SIZE - 1))
     {
@@ -1662,11 +3394,7 @@ bool btree::insert(entry_key_t key, char *right)
     // 5. insert the entry
     leaf->data->kv[pos].ptr = right;
     leaf->data->kv[pos].key = key;
-#ifndef eADR
-    flush_data(&leaf->data->kv[pos], sizeof(entry));
-#else
-    asm_mfence();
-#endif
+    pm_persist_entry(&leaf->data->kv[pos], sizeof(entry));
     leaf->finger_prints[pos] = hash;
 
     // 6. Commit the insert
@@ -1679,16 +3407,134 @@ bool btree::insert(entry_key_t key, char *right)
     break;
   }
 
+  my_mem_stats()->keys++;
+  cache_leaf(leaf);
   return true;
 }
 
+static bool kv_key_less(const std::pair<entry_key_t, char *> &a, const std::pair<entry_key_t, char *> &b)
+{
+  return a.first < b.first;
+}
+
+// insert or update n pairs, kvs is sorted in place and the last pair of a key wins; returns the number of new keys
+int btree::insert_batch(std::pair<entry_key_t, char *> *kvs, int n)
+{
+  epoch_guard guard;
+  leaf_node_t *leaf, *prev;
+  inner_node_t *parent;
+  int fresh[LEAF_NODE_SIZE];
+  uint8_t hash[LEAF_NODE_SIZE];
+  int inserted = 0;
+
+  std::stable_sort(kvs, kvs + n, kv_key_less);
+  int m = 0;
+  for (int i = 0; i < n; i++)
+  {
+    if (i + 1 < n && kvs[i + 1].first == kvs[i].first)
+      continue;
+    kvs[m++] = kvs[i];
+  }
+
+  int i = 0;
+  while (i < m)
+  {
+    // 1. one search for the keys that fall into the same leaf
+    prev = NULL;
+    leaf = inner_node_search(kvs[i].first, (char **)&prev, (inner_node_t **)&parent);
+    int avail = LEAF_NODE_SIZE - (xpline_stripe ? __builtin_popcountll(leaf->claimed) : (int)leaf->number);
+    if (avail <= 0)
+    {
+      leaf->set_split_bit();
+      SplitLeaf(leaf, parent, prev, kvs[i].first);
+      continue;
+    }
+
+    // 2. update the keys that exist, take the new ones until the free slots are used up
+    int end = i, cnt = 0;
+    for (; end < m && kvs[end].first < leaf->high_key && cnt < avail; end++)
+    {
+      uint8_t h = hashfunc(kvs[end].first);
+      int old_slot = find_item(kvs[end].first, leaf, h);
+      if (old_slot >= 0)
+      {
+        modify(leaf, old_slot, kvs[end].first, kvs[end].second);
+        continue;
+      }
+      hash[cnt] = h;
+      fresh[cnt++] = end;
+    }
+    if (cnt == 0)
+    {
+      i = end;
+      continue;
+    }
+
+    // 3. allocate the slots at once, keys that got none go to the next round
+    int slot[LEAF_NODE_SIZE];
+    int got = 0;
+    if (xpline_stripe)
+    {
+      while (got < cnt && (slot[got] = leaf->claim_slot(my_leaf_stripe())) >= 0)
+        got++;
+    }
+    else
+    {
+      uint32_t pos = __sync_fetch_and_add(&leaf->number, cnt);
+      got = (pos >= LEAF_NODE_SIZE) ? 0 : std::min(cnt, (int)(LEAF_NODE_SIZE - pos));
+      for (int j = 0; j < got; j++)
+        slot[j] = pos + j;
+    }
+    if (got == 0)
+    {
+      leaf->set_split_bit();
+      SplitLeaf(leaf, parent, prev, kvs[i].first);
+      continue;
+    }
+    if (got < cnt)
+      end = fresh[got];
+
+    // 4. write the entries, adjacent ones share a flush and all of them one fence
+    uint64_t mask = 0;
+    for (int j = 0; j < got; j++)
+    {
+      leaf->data->kv[slot[j]].ptr = kvs[fresh[j]].second;
+      leaf->data->kv[slot[j]].key = kvs[fresh[j]].first;
+    }
+    for (int j = 0, run; j < got; j += run)
+    {
+      for (run = 1; j + run < got && slot[j + run] == slot[j] + run; run++)
+        ;
+      pm_writeback(&leaf->data->kv[slot[j]], run * sizeof(entry));
+    }
+    pm_drain_entry();
+    for (int j = 0; j < got; j++)
+    {
+      leaf->finger_prints[slot[j]] = hash[j];
+      mask |= 1llu << slot[j];
+    }
+
+    // 5. commit the slots with one CAS, the whole run is redone after a split
+    if (!leaf->set_slots(mask))
+    {
+      SplitLeaf(leaf, parent, prev, kvs[i].first);
+      continue;
+    }
+    inserted += got;
+    i = end;
+  }
+  my_mem_stats()->keys += inserted;
+  return inserted;
+}
+
 bool btree::remove(entry_key_t key)
 {
+  epoch_guard guard;
 
   int old_slot;
   leaf_node_t *leaf;
   bool retry;
-  leaf = inner_node_search(key);
+  leaf = find_cached_leaf(key);
   assert(key < leaf->high_key);
   assert(key >= leaf->low_key);
 
@@ -1703,11 +3549,8 @@ bool btree::remove(entry_key_t key)
 
   // 3. delete the key
   leaf->data->kv[old_slot].key = 0;
-#ifndef eADR
-  flush_data(&leaf->data->kv[old_slot].key, sizeof(entry_key_t));
-#else
-  asm_mfence();
-#endif
+  pm_persist_entry(&leaf->data->kv[old_slot].key, sizeof(entry_key_t));
+  my_mem_stats()->keys--;
   while (leaf->check_split())
   {
     if (leaf->data->log == NULL)
@@ -1718,7 +3561,7 @@ bool btree::remove(entry_key_t key)
     {
       leaf_node_t *new_leaf = (leaf_node_t *)(leaf->log);
       if (key >= new_leaf->high_key)
-        new_leaf = (leaf_node_t *)(new_leaf->next);
+        new_leaf = new_leaf->sibling;
       assert(key >= new_leaf->low_key);
       assert(key < new_leaf->high_key);
       old_slot = find_item(key, new_leaf, hash);
@@ -1726,9 +3569,191 @@ bool btree::remove(entry_key_t key)
         return true;
       // Prevent from delete the new insert
       new_leaf->data->kv[old_slot].key = 0;
-      asm_mfence();
+      pm_persist_entry(&new_leaf->data->kv[old_slot].key, sizeof(entry_key_t));
       leaf = new_leaf;
     }
   }
+
+  // 4. merge an underfull leaf with a neighbour
+  uint32_t deleted = __sync_add_and_fetch(&leaf->deleted, 1);
+  if (leaf->live() < leaf_merge_ratio * LEAF_NODE_SIZE && deleted >= leaf->merge_retry)
+    merge_leaf(leaf, key);
   return true;
 }
+
+// forward iterator over the keys >= start in key order, holds an epoch of the calling thread while alive
+class scan_iterator
+{
+public:
+  scan_iterator(btree *t, entry_key_t start)
+  {
+    epoch_mgr.enter();
+    tree = t;
+    leaf = tree->inner_node_search(start);
+    low = start;
+    fill();
+  }
+
+  ~scan_iterator()
+  {
+    epoch_mgr.exit();
+  }
+
+  bool valid() { return pos < buf.size(); }
+  entry_key_t key() { return buf[pos].first; }
+  char *value() { return buf[pos].second; }
+
+  void next()
+  {
+    if (++pos >= buf.size())
+      fill();
+  }
+
+private:
+  btree *tree;
+  leaf_node_t *leaf; // next leaf to read, NULL behind the last one
+  entry_key_t low;   // every key below has been returned
+  std::vector<scan_entry_t> buf;
+  size_t pos;
+
+  scan_iterator(const scan_iterator &);
+  scan_iterator &operator=(const scan_iterator &);
+
+  // read leaves until one has keys left, each key range is read once, from the leaf that covers it now
+  void fill()
+  {
+    buf.clear();
+    pos = 0;
+    while (buf.empty() && leaf != NULL)
+    {
+      tree->scan_leaf(leaf, low, (~0llu), buf);
+      low = leaf->high_key;
+      leaf = (low == (~0llu)) ? NULL : leaf->next;
+    }
+    std::sort(buf.begin(), buf.end());
+  }
+};
+
+// backward iterator over the keys <= start in descending key order, holds an epoch of the calling thread while alive
+class scan_reverse_iterator
+{
+public:
+  scan_reverse_iterator(btree *t, entry_key_t start)
+  {
+    epoch_mgr.enter();
+    tree = t;
+    parent = NULL;
+    high = (start == (~0llu)) ? start : start + 1;
+    fill();
+  }
+
+  ~scan_reverse_iterator()
+  {
+    epoch_mgr.exit();
+  }
+
+  bool valid() { return pos < buf.size(); }
+  entry_key_t key() { return buf[pos].first; }
+  char *value() { return buf[pos].second; }
+
+  void next()
+  {
+    if (++pos >= buf.size())
+      fill();
+  }
+
+private:
+  btree *tree;
+  inner_node_t *parent; // level 1 node of the last leaf, the previous leaf is looked up from it
+  entry_key_t high;     // every key above or equal has been returned, 0 at the end
+  std::vector<scan_entry_t> buf;
+  size_t pos;
+
+  scan_reverse_iterator(const scan_reverse_iterator &);
+  scan_reverse_iterator &operator=(const scan_reverse_iterator &);
+
+  // the leaf chain only points forward, the previous leaf is the one covering the low key of the last one minus 1
+  void fill()
+  {
+    buf.clear();
+    pos = 0;
+    while (buf.empty() && high != 0)
+    {
+      leaf_node_t *leaf = tree->find_leaf_from(high - 1, &parent);
+      tree->scan_leaf(leaf, leaf->low_key, high, buf);
+      high = leaf->low_key;
+    }
+    std::sort(buf.rbegin(), buf.rend());
+  }
+};
+
+// find the leaf of key from the level 1 node *parent instead of the root, *parent becomes the node the search ends in
+leaf_node_t *btree::find_leaf_from(entry_key_t key, inner_node_t **parent)
+{
+  leaf_node_t *leaf;
+  while (true)
+  {
+    inner_node_t *p = *parent;
+    if (p == NULL || height == 1)
+      leaf = find_leaf(key, parent);
+    else
+    {
+      // neighbours are close, move along the level 1 nodes
+      while (key < p->hdr.low_key && p->hdr.pred_ptr != NULL)
+        p = p->hdr.pred_ptr;
+      while (key >= p->hdr.high_key && p->hdr.sibling_ptr != NULL)
+        p = p->hdr.sibling_ptr;
+      *parent = p;
+      leaf = (leaf_node_t *)p->linear_search(key);
+    }
+    while (key >= leaf->high_key)
+      leaf = leaf->next;
+    if (key >= leaf->low_key)
+      return leaf;
+    *parent = NULL;
+  }
+}
+
+// the committed keys of leaf in [low, high) and in its fences, a split leaf is read through its new leaves
+void btree::scan_leaf(leaf_node_t *leaf, entry_key_t low, entry_key_t high, std::vector<scan_entry_t> &buf)
+{
+  if (leaf->check_split() && leaf->log != NULL)
+  {
+    // help the split, the new leaves hold the whole range once the sync is done; a merged
+    // leaf also holds the range of the other old leaf, which is read on its own
+    sync(leaf);
+    low = std::max(low, leaf->low_key);
+    high = std::min(high, leaf->high_key);
+    scan_leaf(leaf->log, low, high, buf);
+    if (leaf->log->sibling != NULL)
+      scan_leaf(leaf->log->sibling, low, high, buf);
+    return;
+  }
+  uint64_t valid = leaf->valid_slots();
+  while (valid)
+  {
+    int i = __builtin_ctzll(valid);
+    valid &= valid - 1;
+    entry_key_t key = leaf->data->kv[i].key;
+    char *value = leaf->data->kv[i].ptr;
+    if (key == 0 || key < low || key >= high || key < leaf->low_key || key >= leaf->high_key)
+      continue;
+    buf.push_back(scan_entry_t(key, (char *)((uint64_t)value & (~MASK))));
+  }
+}
+
+int btree::scan(entry_key_t start_key, int count, scan_entry_t *out)
+{
+  int n = 0;
+  for (scan_iterator it(this, start_key); n < count && it.valid(); it.next())
+    out[n++] = scan_entry_t(it.key(), it.value());
+  return n;
+}
+
+int btree::scan_reverse(entry_key_t start_key, int count, scan_entry_t *out)
+{
+  int n = 0;
+  for (scan_reverse_iterator it(this, start_key); n < count && it.valid(); it.next())
+    out[n++] = scan_entry_t(it.key(), it.value());
+  return n;
+}
@@ -0,0 +1,316 @@
+#ifndef pm_alloc_h
+#define pm_alloc_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "pm_ptr.h"
+
+/*
+ * Persistent allocator for the PM pool.
+ *
+ * The pool starts with a header page, the rest is cut into PM_CHUNK_SIZE chunks
+ * that are handed out on demand. A chunk serves one size class (64 B .. 4 KB);
+ * its header holds a persistent bitmap with one bit per allocated block.
+ * Every thread bumps through a chunk of its own per size class, freed blocks go
+ * to a lock-free free list of their class and are reused first.
+ *
+ * The bitmaps say what is allocated, but a crash between allocating a block and
+ * linking it into the tree leaks the block. Recovery therefore rebuilds them from
+ * the blocks it can reach (gc_begin, gc_mark, gc_end), which also refills the
+ * free lists. Its flushes follow pm_domain like the tree's.
+ */
+
+#define PM_HEAP_MAGIC 0x4e42484541503031llu
+#define PM_CHUNK_MAGIC 0x4e4243484e4b3031llu
+#define PM_HEAP_HEADER_SIZE 4096
+#define PM_CHUNK_SIZE (4ULL << 20)
+#define PM_MIN_BLOCK 64
+#define PM_NUM_CLASSES 7 // 64 B .. 4 KB
+#define PM_CHUNK_LIST PM_NUM_CLASSES
+#define PM_OFF_MASK ((1llu << 40) - 1) // free list heads keep an ABA tag above the offset
+
+// offset 0 of the pool
+class pm_heap_t
+{
+public:
+  uint64_t magic;
+  uint64_t pool_size;
+  uint64_t num_chunks; // chunks handed out so far
+  uint64_t root;       // offset of the object recovery starts from
+};
+
+class pm_chunk_t
+{
+public:
+  uint64_t magic; // PM_CHUNK_MAGIC once formatted, the free chunk list reuses the word
+  uint32_t size_class;
+  uint32_t first_block;                                // blocks taken by this header
+  uint64_t next_spare;                                 // chunks reserved by a thread
+  uint64_t bitmap[PM_CHUNK_SIZE / PM_MIN_BLOCK / 64]; // only the first blocks() bits are used
+
+  uint64_t block_size() { return (uint64_t)PM_MIN_BLOCK << size_class; }
+  uint32_t blocks() { return PM_CHUNK_SIZE / block_size(); }
+};
+
+// the chunk every thread currently bumps through, per size class
+static __thread uint64_t pm_tls_chunk[PM_NUM_CLASSES];
+static __thread uint32_t pm_tls_next[PM_NUM_CLASSES];
+static __thread uint64_t pm_tls_spare[PM_NUM_CLASSES];
+
+class pm_allocator_t
+{
+private:
+  pm_heap_t *heap = NULL;
+  uint64_t free_list[PM_NUM_CLASSES + 1]; // tagged heads, the last one holds free chunks
+
+  static inline void persist(void *addr, size_t len)
+  {
+    pm_persist(addr, len);
+  }
+
+  static int size_class(size_t size)
+  {
+    int c = 0;
+    while (((size_t)PM_MIN_BLOCK << c) < size)
+      c++;
+    if (c >= PM_NUM_CLASSES)
+    {
+      printf("[NVM MGR]\tno size class for %lu bytes\n", size);
+      exit(-1);
+    }
+    return c;
+  }
+
+  pm_chunk_t *chunk(uint64_t i)
+  {
+    return (pm_chunk_t *)(pm_pool_base + PM_HEAP_HEADER_SIZE + i * PM_CHUNK_SIZE);
+  }
+
+  pm_chunk_t *chunk_of(void *p)
+  {
+    return chunk(((char *)p - pm_pool_base - PM_HEAP_HEADER_SIZE) / PM_CHUNK_SIZE);
+  }
+
+  void push(int list, uint64_t off)
+  {
+    uint64_t head, new_head;
+    do
+    {
+      head = free_list[list];
+      *(uint64_t *)(pm_pool_base + off) = head & PM_OFF_MASK;
+      new_head = off | ((head + (PM_OFF_MASK + 1)) & ~PM_OFF_MASK);
+    } while (!__sync_bool_compare_and_swap(&free_list[list], head, new_head));
+  }
+
+  uint64_t pop(int list)
+  {
+    uint64_t head, off, new_head;
+    do
+    {
+      head = free_list[list];
+      off = head & PM_OFF_MASK;
+      if (off == 0)
+        return 0;
+      new_head = *(uint64_t *)(pm_pool_base + off) | ((head + (PM_OFF_MASK + 1)) & ~PM_OFF_MASK);
+    } while (!__sync_bool_compare_and_swap(&free_list[list], head, new_head));
+    return off;
+  }
+
+  void set_bit(pm_chunk_t *c, uint32_t b)
+  {
+    __sync_fetch_and_or(&c->bitmap[b / 64], 1llu << (b % 64));
+    persist(&c->bitmap[b / 64], sizeof(uint64_t));
+  }
+
+  // format a free or new chunk for size class sc, zeroes all its blocks
+  pm_chunk_t *new_chunk(int sc)
+  {
+    pm_chunk_t *c;
+    uint64_t off = pop(PM_CHUNK_LIST);
+    if (off != 0)
+      c = (pm_chunk_t *)(pm_pool_base + off);
+    else
+    {
+      uint64_t i = __sync_fetch_and_add(&heap->num_chunks, 1);
+      persist(&heap->num_chunks, sizeof(uint64_t));
+      if (PM_HEAP_HEADER_SIZE + (i + 1) * PM_CHUNK_SIZE > heap->pool_size)
+      {
+        printf("[NVM MGR]\tout of pool space, %lu chunks in use\n", i);
+        exit(-1);
+      }
+      c = chunk(i);
+    }
+    memset(c, 0, PM_CHUNK_SIZE);
+    c->size_class = sc;
+    uint64_t header = sizeof(pm_chunk_t) - sizeof(c->bitmap) + (c->blocks() + 63) / 64 * 8;
+    c->first_block = (header + c->block_size() - 1) / c->block_size();
+    persist(c, header);
+    c->magic = PM_CHUNK_MAGIC;
+    persist(&c->magic, sizeof(uint64_t));
+    return c;
+  }
+
+  void reset_thread()
+  {
+    memset(pm_tls_chunk, 0, sizeof(pm_tls_chunk));
+    memset(pm_tls_next, 0, sizeof(pm_tls_next));
+    memset(pm_tls_spare, 0, sizeof(pm_tls_spare));
+  }
+
+public:
+  // format a new pool
+  void create(char *pool, uint64_t size)
+  {
+    pm_pool_base = pool;
+    heap = (pm_heap_t *)pool;
+    memset(heap, 0, PM_HEAP_HEADER_SIZE);
+    heap->pool_size = size;
+    persist(heap, sizeof(pm_heap_t));
+    heap->magic = PM_HEAP_MAGIC;
+    persist(&heap->magic, sizeof(uint64_t));
+    memset(free_list, 0, sizeof(free_list));
+    reset_thread();
+  }
+
+  // map an existing pool, the free lists are empty until gc_end
+  bool open(char *pool)
+  {
+    if (((pm_heap_t *)pool)->magic != PM_HEAP_MAGIC)
+      return false;
+    pm_pool_base = pool;
+    heap = (pm_heap_t *)pool;
+    memset(free_list, 0, sizeof(free_list));
+    reset_thread();
+    return true;
+  }
+
+  // zero = false when the caller overwrites the whole block anyway
+  void *alloc(size_t size, bool zero = true)
+  {
+    int sc = size_class(size);
+    // 1. reuse a freed block
+    uint64_t off = pop(sc);
+    if (off != 0)
+    {
+      void *p = pm_pool_base + off;
+      pm_chunk_t *c = chunk_of(p);
+      if (zero)
+        memset(p, 0, c->block_size());
+      set_bit(c, ((char *)p - (char *)c) / c->block_size());
+      return p;
+    }
+
+    // 2. bump in the chunk of this thread, take a reserved or new chunk when it is used up
+    pm_chunk_t *c = (pm_chunk_t *)(pm_pool_base + pm_tls_chunk[sc]);
+    if (pm_tls_chunk[sc] == 0 || pm_tls_next[sc] >= c->blocks())
+    {
+      if (pm_tls_spare[sc] != 0)
+      {
+        c = (pm_chunk_t *)(pm_pool_base + pm_tls_spare[sc]);
+        pm_tls_spare[sc] = c->next_spare;
+      }
+      else
+        c = new_chunk(sc);
+      pm_tls_chunk[sc] = (char *)c - pm_pool_base;
+      pm_tls_next[sc] = c->first_block;
+    }
+    uint32_t b = pm_tls_next[sc]++;
+    set_bit(c, b);
+    return (char *)c + b * c->block_size();
+  }
+
+  void free(void *p)
+  {
+    pm_chunk_t *c = chunk_of(p);
+    uint32_t b = ((char *)p - (char *)c) / c->block_size();
+    __sync_fetch_and_and(&c->bitmap[b / 64], ~(1llu << (b % 64)));
+    persist(&c->bitmap[b / 64], sizeof(uint64_t));
+    push(c->size_class, (char *)p - pm_pool_base);
+  }
+
+  // format the chunks the calling thread will fill with blocks of size, ahead of time
+  void reserve(size_t size, uint64_t bytes)
+  {
+    int sc = size_class(size);
+    for (uint64_t n = 0; n < bytes; n += PM_CHUNK_SIZE)
+    {
+      pm_chunk_t *c = new_chunk(sc);
+      c->next_spare = pm_tls_spare[sc];
+      pm_tls_spare[sc] = (char *)c - pm_pool_base;
+    }
+  }
+
+  void set_root(void *p)
+  {
+    heap->root = (char *)p - pm_pool_base;
+    persist(&heap->root, sizeof(uint64_t));
+  }
+
+  void *root()
+  {
+    return heap->root == 0 ? NULL : pm_pool_base + heap->root;
+  }
+
+  // bytes a block of the given size takes up
+  static uint64_t block_size(size_t size)
+  {
+    return (uint64_t)PM_MIN_BLOCK << size_class(size);
+  }
+
+  // bytes of the chunks handed out so far, free blocks included
+  uint64_t chunk_bytes()
+  {
+    return heap == NULL ? 0 : heap->num_chunks * PM_CHUNK_SIZE;
+  }
+
+  // recovery: forget all allocations, then mark the reachable blocks again
+  void gc_begin()
+  {
+    for (uint64_t i = 0; i < heap->num_chunks; i++)
+    {
+      pm_chunk_t *c = chunk(i);
+      if (c->magic == PM_CHUNK_MAGIC)
+        memset(c->bitmap, 0, (c->blocks() + 63) / 64 * 8);
+    }
+  }
+
+  // thread safe, the recovery workers mark in parallel
+  void gc_mark(void *p)
+  {
+    pm_chunk_t *c = chunk_of(p);
+    uint32_t b = ((char *)p - (char *)c) / c->block_size();
+    __sync_fetch_and_or(&c->bitmap[b / 64], 1llu << (b % 64));
+  }
+
+  // persist the bitmaps and hand every unmarked block and empty chunk to the free lists
+  void gc_end()
+  {
+    for (uint64_t i = heap->num_chunks; i-- > 0;)
+    {
+      pm_chunk_t *c = chunk(i);
+      uint64_t words = (c->blocks() + 63) / 64;
+      bool empty = true;
+      for (uint64_t w = 0; c->magic == PM_CHUNK_MAGIC && w < words && empty; w++)
+        empty = c->bitmap[w] == 0;
+      if (empty)
+      {
+        push(PM_CHUNK_LIST, (char *)c - pm_pool_base);
+        continue;
+      }
+      persist(c->bitmap, words * 8);
+      for (uint32_t b = c->blocks(); b-- > c->first_block;)
+      {
+        if (!(c->bitmap[b / 64] & (1llu << (b % 64))))
+          push(c->size_class, (char *)c + b * c->block_size() - pm_pool_base);
+      }
+    }
+  }
+};
+
+pm_allocator_t pm_heap;
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef pm_ptr_h
+#define pm_ptr_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+char *pm_pool_base = NULL; // where the pool is mapped in this process
+
+// pointer stored in PM, kept as an offset from the pool base so the pool can be mapped anywhere; 0 is NULL
+template <class T>
+class pm_ptr
+{
+private:
+  uint64_t off;
+
+public:
+  pm_ptr() : off(0) {}
+  pm_ptr(T *p) : off(to_off(p)) {}
+
+  static uint64_t to_off(T *p)
+  {
+    return p == NULL ? 0 : (uint64_t)((char *)p - pm_pool_base);
+  }
+
+  static T *to_ptr(uint64_t o)
+  {
+    return o == 0 ? NULL : (T *)(pm_pool_base + o);
+  }
+
+  T *get() const { return to_ptr(off); }
+  operator T *() const { return get(); }
+  T *operator->() const { return get(); }
+
+  pm_ptr &operator=(T *p)
+  {
+    off = to_off(p);
+    return *this;
+  }
+
+  // raw offset, the low bits may carry a tag
+  uint64_t raw() const { return off; }
+  void set_raw(uint64_t o) { off = o; }
+
+  bool cas(T *expected, T *desired)
+  {
+    return __sync_bool_compare_and_swap(&off, to_off(expected), to_off(desired));
+  }
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef thread_slot_h
+#define thread_slot_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Per-thread slots.
+ * A thread takes the lowest free slot the first time it asks for one and gives
+ * it back when it exits, so any number of threads may come and go as long as at
+ * most MAX_THREADS of them hold a slot at once. Modules that keep state per slot
+ * register an exit hook that runs before the slot is handed to the next thread.
+ */
+
+#define MAX_THREADS 256
+#define THREAD_MAX_HOOKS 4
+
+typedef void (*thread_exit_t)(void *arg, uint32_t slot);
+
+static __thread int thread_tls_slot = -1;
+
+class thread_slots_t
+{
+private:
+  volatile uint8_t used[MAX_THREADS];
+  uint32_t high = 0; // slots ever taken, the owners of [0, high) may hold state
+  pthread_key_t key;
+  thread_exit_t hooks[THREAD_MAX_HOOKS];
+  void *args[THREAD_MAX_HOOKS];
+  uint32_t num_hooks = 0;
+
+  // pthread key destructor, the value is 1 + the slot of the exiting thread
+  static void release(void *value);
+
+public:
+  thread_slots_t()
+  {
+    for (int i = 0; i < MAX_THREADS; i++)
+      used[i] = 0;
+    pthread_key_create(&key, release);
+  }
+
+  // slot of the calling thread
+  uint32_t get()
+  {
+    if (thread_tls_slot >= 0)
+      return thread_tls_slot;
+    for (uint32_t i = 0; i < MAX_THREADS; i++)
+    {
+      if (used[i] == 0 && __sync_bool_compare_and_swap(&used[i], 0, 1))
+      {
+        uint32_t h;
+        while ((h = high) < i + 1 && !__sync_bool_compare_and_swap(&high, h, i + 1))
+          ;
+        thread_tls_slot = i;
+        pthread_setspecific(key, (void *)(uintptr_t)(i + 1));
+        return i;
+      }
+    }
+    printf("[THREAD]\tmore than %d threads at once\n", MAX_THREADS);
+    exit(-1);
+  }
+
+  // number of slots a sum over all threads has to look at
+  uint32_t size()
+  {
+    return __atomic_load_n(&high, __ATOMIC_ACQUIRE);
+  }
+
+  // hook(arg, slot) runs on a thread that exits while it holds slot; register before threads start
+  void at_exit(thread_exit_t hook, void *arg)
+  {
+    if (num_hooks == THREAD_MAX_HOOKS)
+    {
+      printf("[THREAD]\tmore than %d exit hooks\n", THREAD_MAX_HOOKS);
+      exit(-1);
+    }
+    hooks[num_hooks] = hook;
+    args[num_hooks] = arg;
+    num_hooks++;
+  }
+};
+
+thread_slots_t thread_slots;
+
+// one T per slot. A slot keeps its state when its thread exits and the next owner goes on from there,
+// so counters summed over [0, size()) count every thread that ever ran
+template <class T>
+class per_thread_t
+{
+private:
+  T slots[MAX_THREADS];
+
+public:
+  T *mine()
+  {
+    return &slots[thread_slots.get()];
+  }
+
+  T &operator[](uint32_t i)
+  {
+    return slots[i];
+  }
+
+  uint32_t size()
+  {
+    return thread_slots.size();
+  }
+};
+
+inline void thread_slots_t::release(void *value)
+{
+  uint32_t slot = (uint32_t)(uintptr_t)value - 1;
+  for (uint32_t i = 0; i < thread_slots.num_hooks; i++)
+    thread_slots.hooks[i](thread_slots.args[i], slot);
+  thread_tls_slot = -1;
+  __atomic_store_n(&thread_slots.used[slot], 0, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -6,11 +6,13 @@
 #include <map>
 #include <mutex>
 #include <cstdio>
+#include <cstring>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <cpuid.h>
 
 #include <bits/stdc++.h>
 
@@ -59,6 +61,11 @@ static __always_inline uint64_t rdtsc()
 	asm volatile(".byte 0x66; xsaveopt %0" \
 				 : "+m"(*(volatile char *)addr));
 
+// clflushopt, the same 0x66 prefix trick on clflush
+#define asm_clflushopt(addr)                  \
+	asm volatile(".byte 0x66; clflush %0" \
+				 : "+m"(*(volatile char *)addr));
+
 #define asm_clflush(addr)                   \
 	({                                      \
 		__asm__ __volatile__("clflush %0"   \
@@ -82,34 +89,242 @@ static __always_inline uint64_t rdtsc()
 			__asm__ __volatile__("sfence"); \
 		})
 
+// non-temporal store of one word, it bypasses the cache and is ordered by asm_sfence
+#define asm_movnti(addr, val)                    \
+	asm volatile("movnti %1, %0"                 \
+				 : "=m"(*(volatile uint64_t *)(addr)) \
+				 : "r"((uint64_t)(val)));
+
 #define CACHE_ALIGN 64
 
-// #define NO_CACHELINE_FLUSH
 /*
- * TODO: Now our cpu only support clflush, which is less effcient than clflushopt;
- * If clflushopt is available, we should add an automatic choice between these two instructions.
+ * Media write model of an Optane DIMM, off unless pm_media_model is set.
+ * The media is written in XPLINE_SIZE units. Every range the tree persists is
+ * taken to reach the DIMM when it is persisted, as with ADR, and its lines go
+ * into a write-combining buffer of PM_XPBUFFER_ENTRIES XPLines. An XPLine that
+ * leaves the buffer (least recently written first) costs one media write, and a
+ * read-modify-write if some of its lines were not written. The buffer is shared
+ * under one lock, the model is for measuring only.
  */
-static void flush_data(void *addr, size_t len)
+#define XPLINE_SIZE 256
+#define PM_XPBUFFER_ENTRIES 64
+
+struct pm_media_stats_t
+{
+	uint64_t persisted; // bytes the tree asked to persist
+	uint64_t lines;		// lines that reached the buffer
+	uint64_t xplines;	// XPLines written to the media
+	uint64_t partial;	// ... of them read-modify-writes
+};
+
+static bool pm_media_model = false;
+static volatile int pm_media_lock = 0;
+static pm_media_stats_t pm_media_stats;
+static uint64_t pm_xpbuffer_tag[PM_XPBUFFER_ENTRIES]; // XPLine address, 0 if the entry is unused
+static uint64_t pm_xpbuffer_used[PM_XPBUFFER_ENTRIES];
+static uint8_t pm_xpbuffer_lines[PM_XPBUFFER_ENTRIES];
+static uint64_t pm_xpbuffer_clock = 0;
+
+static void pm_media_evict(int i)
+{
+	pm_media_stats.xplines++;
+	if (pm_xpbuffer_lines[i] != (1 << (XPLINE_SIZE / CACHE_ALIGN)) - 1)
+		pm_media_stats.partial++;
+	pm_xpbuffer_tag[i] = 0;
+	pm_xpbuffer_lines[i] = 0;
+}
+
+static void pm_media_write(const void *addr, size_t len)
+{
+	while (!__sync_bool_compare_and_swap(&pm_media_lock, 0, 1))
+		asm("pause");
+	pm_media_stats.persisted += len;
+	uint64_t end = (uint64_t)addr + len;
+	for (uint64_t line = (uint64_t)addr & ~(uint64_t)(CACHE_ALIGN - 1); line < end; line += CACHE_ALIGN)
+	{
+		uint64_t tag = line & ~(uint64_t)(XPLINE_SIZE - 1);
+		int i, victim = 0;
+		for (i = 0; i < PM_XPBUFFER_ENTRIES && pm_xpbuffer_tag[i] != tag; i++)
+			if (pm_xpbuffer_used[i] < pm_xpbuffer_used[victim])
+				victim = i;
+		if (i == PM_XPBUFFER_ENTRIES)
+		{
+			i = victim;
+			if (pm_xpbuffer_tag[i] != 0)
+				pm_media_evict(i);
+			pm_xpbuffer_tag[i] = tag;
+		}
+		pm_xpbuffer_lines[i] |= 1 << ((line % XPLINE_SIZE) / CACHE_ALIGN);
+		pm_xpbuffer_used[i] = ++pm_xpbuffer_clock;
+		pm_media_stats.lines++;
+	}
+	__atomic_store_n(&pm_media_lock, 0, __ATOMIC_RELEASE);
+}
+
+// start counting from an empty buffer
+static inline void pm_media_reset()
+{
+	memset(&pm_media_stats, 0, sizeof(pm_media_stats));
+	memset(pm_xpbuffer_tag, 0, sizeof(pm_xpbuffer_tag));
+	memset(pm_xpbuffer_used, 0, sizeof(pm_xpbuffer_used));
+	memset(pm_xpbuffer_lines, 0, sizeof(pm_xpbuffer_lines));
+}
+
+// the XPLines still buffered count as written, ops is the number of operations that persisted
+static inline void pm_media_report(uint64_t ops)
+{
+	if (!pm_media_model)
+		return;
+	for (int i = 0; i < PM_XPBUFFER_ENTRIES; i++)
+		if (pm_xpbuffer_tag[i] != 0)
+			pm_media_evict(i);
+	pm_media_stats_t &st = pm_media_stats;
+	printf("[PM MEDIA]\tpersisted %lu KB in %lu lines, %lu XPLine writes (%lu read-modify-write), media %lu KB\n",
+		   st.persisted >> 10, st.lines, st.xplines, st.partial, st.xplines * XPLINE_SIZE >> 10);
+	printf("[PM MEDIA]\twrite ratio %.2f media bytes per persisted byte, %.2f per line, %.0f per operation\n",
+		   st.persisted ? (double)st.xplines * XPLINE_SIZE / st.persisted : 0.0,
+		   st.lines ? (double)st.xplines * XPLINE_SIZE / (st.lines * CACHE_ALIGN) : 0.0,
+		   ops ? (double)st.xplines * XPLINE_SIZE / ops : 0.0);
+}
+
+// copy len bytes (a multiple of 8) with non-temporal stores, no read-for-ownership of the target lines
+static void nt_copy(void *dst, const void *src, size_t len)
+{
+	uint64_t *d = (uint64_t *)dst;
+	const uint64_t *s = (const uint64_t *)src;
+	for (size_t i = 0; i < len / 8; i++)
+		asm_movnti(&d[i], s[i]);
+	if (pm_media_model)
+		pm_media_write(dst, len);
+}
+
+/*
+ * Persistence domain of the pool, set before the pool is used (eADR by default):
+ *   PM_EADR: the caches are persistent, a store is durable once it is visible
+ *   PM_ADR: lines are written back and ordered by sfence before they count as durable
+ *   PM_VOLATILE: nothing is made durable, e.g. a pool in DRAM
+ * The write-back instruction is the best one CPUID reports: clwb, clflushopt or clflush.
+ */
+enum pm_domain_t
+{
+	PM_EADR,
+	PM_ADR,
+	PM_VOLATILE,
+	_PM_DOMAIN_NUMBER
+};
+
+enum pm_flush_t
+{
+	PM_CLWB,
+	PM_CLFLUSHOPT,
+	PM_CLFLUSH
+};
+
+static pm_flush_t pm_flush_select()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+	{
+		if (ebx & bit_CLWB)
+			return PM_CLWB;
+		if (ebx & bit_CLFLUSHOPT)
+			return PM_CLFLUSHOPT;
+	}
+	return PM_CLFLUSH;
+}
+
+static pm_domain_t pm_domain = PM_EADR;
+static const pm_flush_t pm_flush = pm_flush_select();
+
+static inline const char *pm_domain_name(pm_domain_t domain)
+{
+	static const char *names[] = {"eADR", "ADR", "volatile"};
+	return names[domain];
+}
+
+static inline const char *pm_flush_name(pm_flush_t flush)
+{
+	static const char *names[] = {"clwb", "clflushopt", "clflush"};
+	return names[flush];
+}
+
+// write the lines of [addr, addr + len) back, not ordered
+static inline void writeback_lines(void *addr, size_t len)
 {
-#ifndef NO_CACHELINE_FLUSH
 	char *end = (char *)(addr) + len;
 	char *ptr = (char *)((unsigned long)addr & ~(CACHE_ALIGN - 1));
-	for (; ptr < end; ptr += CACHE_ALIGN)
-		asm_clwb(ptr);
-	asm_mfence();
+	switch (pm_flush)
+	{
+	case PM_CLWB:
+		for (; ptr < end; ptr += CACHE_ALIGN)
+			asm_clwb(ptr);
+		break;
+	case PM_CLFLUSHOPT:
+		for (; ptr < end; ptr += CACHE_ALIGN)
+			asm_clflushopt(ptr);
+		break;
+	default:
+		for (; ptr < end; ptr += CACHE_ALIGN)
+			asm_clflush(ptr);
+		break;
+	}
+}
+
+// #define NO_CACHELINE_FLUSH
+static void flush_data(void *addr, size_t len)
+{
+#ifndef NO_CACHELINE_FLUSH
+	writeback_lines(addr, len);
+	asm_sfence();
 #endif
 }
-static void flush_data_eADR(void *addr, size_t len)
+
+// [addr, addr + len) is durable before the stores that follow
+static inline void pm_persist(void *addr, size_t len)
+{
+	if (pm_media_model)
+		pm_media_write(addr, len);
+	if (pm_domain == PM_ADR)
+		flush_data(addr, len);
+}
+
+// pm_persist of an entry the next store publishes, with eADR an mfence orders the two
+static inline void pm_persist_entry(void *addr, size_t len)
+{
+	if (pm_media_model)
+		pm_media_write(addr, len);
+	if (pm_domain == PM_ADR)
+		flush_data(addr, len);
+	else if (pm_domain == PM_EADR)
+		asm_mfence();
+}
+
+// pm_persist in two halves, the write-backs of several ranges share one pm_drain
+static inline void pm_writeback(void *addr, size_t len)
 {
+	if (pm_media_model)
+		pm_media_write(addr, len);
 #ifndef NO_CACHELINE_FLUSH
-	char *end = (char *)(addr) + len;
-	char *ptr = (char *)((unsigned long)addr & ~(CACHE_ALIGN - 1));
-	for (; ptr < end; ptr += CACHE_ALIGN)
-		asm_clwb(ptr);
-		// asm_clflushopt(ptr);
+	if (pm_domain == PM_ADR)
+		writeback_lines(addr, len);
 #endif
 }
 
+static inline void pm_drain()
+{
+	if (pm_domain == PM_ADR)
+		asm_sfence();
+}
+
+// pm_drain of entries the next store publishes, with eADR an mfence orders them
+static inline void pm_drain_entry()
+{
+	if (pm_domain == PM_ADR)
+		asm_sfence();
+	else if (pm_domain == PM_EADR)
+		asm_mfence();
+}
+
 // prefetch instruction
 //
 #define CACHE_LINE_SIZE 64
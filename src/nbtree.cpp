@@ -17,18 +17,24 @@
 #include "nbtree_w.h"
 #else
 #include "nbtree.h"
+// only the lock-free tree keeps its metadata in the pool, can be recovered and supports scans
+#define NBTREE_PERSISTENT
 #endif
 #endif
 
+uint64_t allocate_size = 113ULL * 1024ULL * 1024ULL * 1024ULL;
+uint64_t allocate_mem = 113ULL * 1024ULL * 1024ULL * 1024ULL;
+
+#ifndef NBTREE_PERSISTENT
+// per-thread regions of the PM pool and of the DRAM arena
 char *thread_space_start_addr;
 __thread char *start_addr;
 __thread char *curr_addr;
-uint64_t allocate_size = 113ULL * 1024ULL * 1024ULL * 1024ULL;
 
 char *thread_mem_start_addr;
 __thread char *start_mem;
 __thread char *curr_mem;
-uint64_t allocate_mem = 113ULL * 1024ULL * 1024ULL * 1024ULL;
+#endif
 
 using namespace std;
 
@@ -131,15 +137,29 @@ public:
 	{
 		long long lat;
 		nsTimer clk;
+#ifndef NBTREE_PERSISTENT
 		start_addr = thread_space_start_addr + workerid * SPACE_PER_THREAD;
 		curr_addr = start_addr;
 		start_mem = thread_mem_start_addr + workerid * MEM_PER_THREAD;
 		curr_mem = start_mem;
+#endif
 
 		Benchmark *benchmark = getBenchmark(conf, workerid);
+#ifdef NBTREE_PERSISTENT
+		std::vector<scan_entry_t> scan_buf(conf.scan_length);
+		std::vector<entry_key_t> batch_keys(conf.batch);
+		std::vector<char *> batch_out(conf.batch);
+		std::vector<std::pair<entry_key_t, char *>> batch_kvs(conf.batch);
+		int batch_n = 0, batch_kv_n = 0;
+#endif
 		if (conf.benchmark == INSERT_ONLY || conf.benchmark == UPSERT)
 		{
+#ifdef NBTREE_PERSISTENT
+			// format the chunks this worker will split into before the clock starts
+			pm_heap.reserve(sizeof(data_node_t), SPACE_PER_THREAD);
+#else
 			memset(start_addr, 0, SPACE_PER_THREAD);
+#endif
 			clear_cache();
 		}
 
@@ -152,12 +172,27 @@ public:
 			volatile auto next_operation = benchmark->nextOperation();
 			OperationType op = next_operation.first;
 			long long d = next_operation.second;
+			int ran = 1; // operations that reached the tree, 0 while a batch fills
 		#ifdef PERF_LATENCY
 			clk.start();
 		#endif
 			switch (op)
 			{
 			case INSERT:
+#ifdef NBTREE_PERSISTENT
+				if (conf.batch > 1)
+				{
+					batch_kvs[batch_kv_n++] = std::make_pair((entry_key_t)d, (char *)(d));
+					ran = 0;
+					if (batch_kv_n == conf.batch)
+					{
+						tree->insert_batch(batch_kvs.data(), batch_kv_n);
+						ran = batch_kv_n;
+						batch_kv_n = 0;
+					}
+					break;
+				}
+#endif
 				tree->insert(d, (char *)(d));
 				break;
 			case REMOVE:
@@ -167,18 +202,72 @@ public:
 				tree->update(d, (char *)(d + result->throughput + 1));
 				break;
 			case GET:
+#ifdef NBTREE_PERSISTENT
+				if (conf.batch > 1)
+				{
+					// the lookups of a batch run together once it is full
+					batch_keys[batch_n++] = d;
+					ran = 0;
+					if (batch_n == conf.batch)
+					{
+						tree->multi_search(batch_keys.data(), batch_n, batch_out.data());
+						ran = batch_n;
+						batch_n = 0;
+					}
+					break;
+				}
+#endif
 				tree->search(d);
 				break;
+#ifdef NBTREE_PERSISTENT
+			case SCAN:
+				tree->scan(d, conf.scan_length, scan_buf.data());
+				break;
+			case SCAN_REVERSE:
+				tree->scan_reverse(d, conf.scan_length, scan_buf.data());
+				break;
+#endif
 			default:
 				printf("not support such operation: %d\n", op);
 				exit(-1);
 			}
+			if (ran == 0)
+				continue;
 		#ifdef PERF_LATENCY
+			// every operation of a batch waited for the whole batch
 			lat = clk.end();
-			result->lat[lat/10] +=1;	
+			result->lat[lat/10] += ran;
 		#endif
-			result->throughput++;
+			result->throughput += ran;
 		}
+
+#ifdef NBTREE_PERSISTENT
+		// the partial batches left when the clock stopped
+		if (batch_n > 0)
+		{
+		#ifdef PERF_LATENCY
+			clk.start();
+		#endif
+			tree->multi_search(batch_keys.data(), batch_n, batch_out.data());
+		#ifdef PERF_LATENCY
+			lat = clk.end();
+			result->lat[lat/10] += batch_n;
+		#endif
+			result->throughput += batch_n;
+		}
+		if (batch_kv_n > 0)
+		{
+		#ifdef PERF_LATENCY
+			clk.start();
+		#endif
+			tree->insert_batch(batch_kvs.data(), batch_kv_n);
+		#ifdef PERF_LATENCY
+			lat = clk.end();
+			result->lat[lat/10] += batch_kv_n;
+		#endif
+			result->throughput += batch_kv_n;
+		}
+#endif
 	}
 
 	void run()
@@ -196,6 +285,23 @@ public:
 			exit(-1);
 		}
 		void *pmem = mmap(NULL, allocate_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#ifdef NBTREE_PERSISTENT
+		if (conf.pm_domain < 0 || conf.pm_domain >= _PM_DOMAIN_NUMBER)
+		{
+			printf("[NVM MGR]\tunknown persistence domain %d\n", conf.pm_domain);
+			exit(-1);
+		}
+		pm_domain = (pm_domain_t)conf.pm_domain;
+		printf("[NVM MGR]\tpersistence domain %s, write-back by %s\n", pm_domain_name(pm_domain), pm_flush_name(pm_flush));
+		if (!conf.recover)
+			pm_heap.create((char *)pmem, allocate_size);
+		dram_arena.init(allocate_mem);
+		htm_retries = conf.htm_retries;
+		htm_backoff = conf.htm_backoff;
+		xpline_stripe = conf.xpline_stripe;
+		leaf_compact_ratio = conf.compact_ratio;
+		leaf_merge_ratio = conf.merge_ratio;
+#else
 		memset(pmem, 0, SPACE_OF_MAIN_THREAD);
 		start_addr = (char *)pmem;
 		curr_addr = start_addr;
@@ -204,23 +310,46 @@ public:
 		start_mem = (char *)mem;
 		curr_mem = start_mem;
 		thread_mem_start_addr = (char *)mem + MEM_OF_MAIN_THREAD;
-		
-		// Warm-up
-		printf("[COORDINATOR]\tWarm-up..\n");
-		btree *tree = new btree();
+#endif
+
+		btree *tree;
 		Benchmark *benchmark = getBenchmark(conf);
 		nsTimer init, runtime;
-		init.start();
-		for (unsigned long i = 0; i < conf.init_keys; i++)
+		if (conf.recover)
+		{
+			// Recovery
+			printf("[COORDINATOR]\tRecovery..\n");
+			tree = recover_tree((char *)pmem);
+		}
+		else
 		{
+			// Warm-up
+			printf("[COORDINATOR]\tWarm-up..\n");
+			tree = new btree();
+			init.start();
+			if (conf.bulk_load > 0)
+				bulk_load_tree(tree, benchmark);
+			else
+			{
+				for (unsigned long i = 0; i < conf.init_keys; i++)
+				{
 
-			uint64_t key = benchmark->nextInitKey();
-			tree->insert(key, (char *)key);
+					uint64_t key = benchmark->nextInitKey();
+					tree->insert(key, (char *)key);
+				}
+			}
+			init.end();
+			clear_cache();
+			printf("warm-up time:%.3f ms\n", init.duration() / 1000000.0);
+			printf("average insert time:%.3f us\n", init.duration() / conf.init_keys / 1000.0);
 		}
-		init.end();
-		clear_cache();
-		printf("warm-up time:%.3f ms\n", init.duration() / 1000000.0);
-		printf("average insert time:%.3f us\n", init.duration() / conf.init_keys / 1000.0);
+#ifdef NBTREE_PERSISTENT
+		dram_arena.report("before benchmark");
+		// only the workers use the leaf cache, its hit rate is the one of the benchmark
+		leaf_cache_size = std::max(0, std::min(conf.leaf_cache, LEAF_CACHE_MAX));
+		pm_media_reset();
+		pm_media_model = conf.media_model;
+#endif
 
 		// Start benchmark
 		printf("[COORDINATOR]\tStart benchmark..\n");
@@ -257,11 +386,82 @@ public:
 		print_taillatency(final_result.lat, final_result.throughput, "total");
 #endif
 
+#ifdef NBTREE_PERSISTENT
+		dram_arena.report("after benchmark");
+		epoch_mgr.report();
+		htm_report();
+		leaf_cache_report();
+		split_report();
+		memory_report();
+		if (xpline_stripe)
+			printf("[PM MEDIA]\tinserts striped over %d XPLines per leaf\n", LEAF_STRIPES);
+		pm_media_report(final_result.throughput);
+		tree->shutdown();
+#endif
 		delete tree;
 		delete[] pid;
 		delete[] results;
 	}
 
+	btree *recover_tree(char *pool)
+	{
+#ifndef NBTREE_PERSISTENT
+		printf("[NVM MGR]\trecovery is not supported by this tree\n");
+		exit(-1);
+#else
+		// recovery time versus threads, the first pass also repairs the pool
+		btree *tree = NULL;
+		uint64_t mem = dram_arena.mark();
+		mem_stats_save();
+		for (int threads = 1;; threads = min(threads * 2, conf.num_threads))
+		{
+			nsTimer clk;
+			// the nodes of the tree of the previous pass go back to the arena and out of the counters
+			dram_arena.rewind(mem);
+			mem_stats_restore();
+			clear_cache();
+			clk.start();
+			tree = btree::recover(pool, threads);
+			clk.end();
+			if (tree == NULL)
+			{
+				printf("[NVM MGR]\tno tree in nvm file\n");
+				exit(-1);
+			}
+			printf("recovery threads:%d time:%.3f ms walk:%.3f ms groups:%u\n", threads, clk.duration() / 1000000.0,
+				   tree->recover_walk_ns / 1000000.0, tree->recover_groups);
+			if (threads == conf.num_threads)
+				break;
+			delete tree;
+		}
+		clear_cache();
+		return tree;
+#endif
+	}
+
+	void bulk_load_tree(btree *tree, Benchmark *benchmark)
+	{
+#ifndef NBTREE_PERSISTENT
+		printf("[COORDINATOR]\tbulk load is not supported by this tree\n");
+		exit(-1);
+#else
+		// the same keys the inserts would use, sorted
+		std::vector<std::pair<entry_key_t, char *>> kvs(conf.init_keys);
+		for (unsigned long i = 0; i < conf.init_keys; i++)
+		{
+			uint64_t key = benchmark->nextInitKey();
+			kvs[i] = std::make_pair(key, (char *)key);
+		}
+		std::sort(kvs.begin(), kvs.end());
+		kvs.erase(std::unique(kvs.begin(), kvs.end()), kvs.end());
+		nsTimer clk;
+		clk.start();
+		tree->bulk_load(kvs.begin(), kvs.end(), conf.bulk_load, conf.num_threads);
+		clk.end();
+		printf("bulk load threads:%d time:%.3f ms\n", conf.num_threads, clk.duration() / 1000000.0);
+#endif
+	}
+
 private:
 	Config conf __attribute__((aligned(64)));
 	volatile int done __attribute__((aligned(64))) = 0;
@@ -0,0 +1,270 @@
+#include "util.h"
+#include "timer.h"
+
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include "nbtree.h"
+#include "microbench.h"
+
+/*
+ * Node-level micro benchmarks, run without PM:
+ *   -m 0: fingerprint probe of a leaf, scalar vs vector, at 1/8/31 occupied slots
+ *   -m 1: false-positive PM key reads per lookup of every fingerprint hash policy
+ *   -m 2: tree lookups with the scalar vs vector inner node search, per tree height
+ *   -m 3: tree height and lookups with wide vs compact inner nodes
+ */
+
+
+enum NodeBenchType
+{
+  FP_PROBE,
+  FP_HASH_FP,
+  INNER_PROBE,
+  INNER_COMPACT,
+  _NodeBenchType
+};
+
+static int bench_type = FP_PROBE;
+static uint64_t lookups = 10000000;
+static const int num_leaves = 1024;
+
+static void *alloc_region(uint64_t size)
+{
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED)
+  {
+    printf("[NODE BENCH]\tfailed to map %lu bytes\n", size);
+    exit(-1);
+  }
+  return addr;
+}
+
+static void fp_probe_bench()
+{
+  const int occupancy[] = {1, 8, LEAF_NODE_SIZE};
+  fp_probe_t probes[3];
+  int num_probes = 0;
+  RandomGenerator rdm;
+
+  probes[num_probes++] = fp_probe_scalar;
+  if (__builtin_cpu_supports("avx2"))
+    probes[num_probes++] = fp_probe_avx2;
+  if (__builtin_cpu_supports("avx512bw"))
+    probes[num_probes++] = fp_probe_avx512;
+
+  printf("[NODE BENCH]\tfingerprint probe, selected at startup: %s\n", fp_probe_name(fp_probe));
+  for (int o = 0; o < 3; ++o)
+  {
+    int n = occupancy[o];
+    leaf_node_t **leaves = new leaf_node_t *[num_leaves];
+    entry_key_t *keys = new entry_key_t[(uint64_t)num_leaves * n];
+    for (int l = 0; l < num_leaves; ++l)
+    {
+      leaves[l] = new (leaf_alloc(sizeof(leaf_node_t))) leaf_node_t;
+      for (int i = 0; i < n; ++i)
+      {
+        entry_key_t key = ((uint64_t)rdm.randomInt() << 20) + (uint64_t)l * n + i + 1;
+        keys[(uint64_t)l * n + i] = key;
+        leaves[l]->fill_slot(i, key, (char *)key, fp_hash_t::hash(key));
+        leaves[l]->set_slot(i);
+      }
+      leaves[l]->number = n;
+    }
+
+    // one positive and one negative lookup per round
+    for (int p = 0; p < num_probes; ++p)
+    {
+      nsTimer clk;
+      uint64_t found = 0;
+      clk.start();
+      for (uint64_t i = 0; i < lookups; ++i)
+      {
+        int l = i % num_leaves;
+        entry_key_t key = keys[(uint64_t)l * n + (i / num_leaves) % n];
+        found += leaves[l]->find_item(key, fp_hash_t::hash(key), probes[p]) >= 0;
+        found += leaves[l]->find_item(key + 1, fp_hash_t::hash(key + 1), probes[p]) >= 0;
+      }
+      clk.end();
+      printf("slots:%d\t%s:\t%.2f ns/lookup (found %lu)\n", n, fp_probe_name(probes[p]),
+             clk.duration() / (2.0 * lookups), found);
+    }
+    delete[] keys;
+    delete[] leaves;
+  }
+}
+
+// full leaves holding the clustered keys of InsertOnlyBench, (d + 1) * INTERVAL + x
+template <class Hash>
+static void fp_hash_bench()
+{
+  RandomGenerator rdm;
+  const int keys_per_leaf = LEAF_NODE_SIZE;
+  leaf_node_t **leaves = new leaf_node_t *[num_leaves];
+  entry_key_t *keys = new entry_key_t[(uint64_t)num_leaves * keys_per_leaf];
+  entry_key_t d = 0;
+  for (int l = 0; l < num_leaves; ++l)
+  {
+    leaves[l] = new (leaf_alloc(sizeof(leaf_node_t))) leaf_node_t;
+    for (int i = 0; i < keys_per_leaf; ++i)
+    {
+      // odd x only, so that key + 1 is a miss in the same leaf
+      entry_key_t key = (++d + 1) * INTERVAL + (rdm.randomInt() % (INTERVAL / 2 - 1)) * 2 + 1;
+      keys[(uint64_t)l * keys_per_leaf + i] = key;
+      leaves[l]->fill_slot(i, key, (char *)key, Hash::hash(key));
+      leaves[l]->set_slot(i);
+    }
+    leaves[l]->number = keys_per_leaf;
+  }
+
+  uint64_t hit_reads = 0, miss_reads = 0;
+  nsTimer clk;
+  clk.start();
+  for (uint64_t i = 0; i < lookups; ++i)
+  {
+    int l = i % num_leaves;
+    entry_key_t key = keys[(uint64_t)l * keys_per_leaf + (i / num_leaves) % keys_per_leaf];
+    // every fingerprint match except the key itself is a wasted PM read
+    hit_reads += __builtin_popcountll(fp_probe(leaves[l]->finger_prints, Hash::hash(key), LEAF_NODE_SIZE) &
+                                      leaves[l]->bitmap & FULL) - 1;
+    miss_reads += __builtin_popcountll(fp_probe(leaves[l]->finger_prints, Hash::hash(key + 1), LEAF_NODE_SIZE) &
+                                       leaves[l]->bitmap & FULL);
+  }
+  clk.end();
+  printf("%s:\tfalse positives per hit %.4f, per miss %.4f, %.2f ns/lookup\n", Hash::name(),
+         (double)hit_reads / lookups, (double)miss_reads / lookups, clk.duration() / (2.0 * lookups));
+  delete[] keys;
+  delete[] leaves;
+}
+
+// bulk loaded trees of 2 to 5 levels, every lookup hits
+static void inner_probe_bench()
+{
+  const uint64_t sizes[] = {400, 8000, 170000, 3500000};
+  inner_probe_t probes[3];
+  int num_probes = 0;
+  RandomGenerator rdm;
+
+  probes[num_probes++] = inner_probe_scalar;
+  if (__builtin_cpu_supports("avx2"))
+    probes[num_probes++] = inner_probe_avx2;
+  if (__builtin_cpu_supports("avx512f"))
+    probes[num_probes++] = inner_probe_avx512;
+  inner_probe_t selected = inner_probe;
+
+  printf("[NODE BENCH]\tinner node search, selected at startup: %s\n", inner_probe_name(selected));
+  for (int s = 0; s < 4; ++s)
+  {
+    uint64_t n = sizes[s];
+    std::vector<std::pair<entry_key_t, char *>> kvs(n);
+    for (uint64_t i = 0; i < n; ++i)
+      kvs[i] = std::make_pair((i + 1) * INTERVAL, (char *)((i + 1) * INTERVAL));
+    btree *tree = new btree();
+    tree->bulk_load(kvs.begin(), kvs.end());
+    entry_key_t *keys = new entry_key_t[lookups];
+    for (uint64_t i = 0; i < lookups; ++i)
+      keys[i] = (rdm.randomInt() % n + 1) * INTERVAL;
+
+    for (int p = 0; p < num_probes; ++p)
+    {
+      nsTimer clk;
+      uint64_t found = 0;
+      inner_probe = probes[p];
+      inner_probe_compact = inner_probe_compact_for(probes[p]);
+      clk.start();
+      for (uint64_t i = 0; i < lookups; ++i)
+        found += tree->search(keys[i]) != NULL;
+      clk.end();
+      printf("keys:%lu\theight:%d\t%s:\t%.2f ns/lookup (found %lu)\n", n, tree->get_height(),
+             inner_probe_name(probes[p]), clk.duration() / (double)lookups, found);
+    }
+    inner_probe = selected;
+    inner_probe_compact = inner_probe_compact_for(selected);
+    delete[] keys;
+  }
+}
+
+// bulk loaded trees, the same keys with 16-byte and with 8-byte inner records
+static void inner_compact_bench()
+{
+  const uint64_t sizes[] = {400000, 8000000};
+  RandomGenerator rdm;
+  bool selected = inner_compact;
+
+  printf("[NODE BENCH]\tinner nodes, %d wide or %d compact records\n", cardinality, cardinality_compact);
+  for (int s = 0; s < 2; ++s)
+  {
+    uint64_t n = sizes[s];
+    std::vector<std::pair<entry_key_t, char *>> kvs(n);
+    for (uint64_t i = 0; i < n; ++i)
+      kvs[i] = std::make_pair((i + 1) * INTERVAL, (char *)((i + 1) * INTERVAL));
+    entry_key_t *keys = new entry_key_t[lookups];
+    for (uint64_t i = 0; i < lookups; ++i)
+      keys[i] = (rdm.randomInt() % n + 1) * INTERVAL;
+
+    for (int c = 0; c < 2; ++c)
+    {
+      inner_compact = (c == 1);
+      btree *tree = new btree();
+      tree->bulk_load(kvs.begin(), kvs.end());
+      nsTimer clk;
+      uint64_t found = 0;
+      clk.start();
+      for (uint64_t i = 0; i < lookups; ++i)
+        found += tree->search(keys[i]) != NULL;
+      clk.end();
+      printf("keys:%lu\t%s:\theight:%d\t%.2f ns/lookup (found %lu)\n", n, inner_compact ? "compact" : "wide",
+             tree->get_height(), clk.duration() / (double)lookups, found);
+    }
+    delete[] keys;
+  }
+  inner_compact = selected;
+}
+
+int main(int argc, char **argv)
+{
+  int c;
+  while ((c = getopt(argc, argv, "m:k:")) != -1)
+  {
+    switch (c)
+    {
+    case 'm':
+      bench_type = atoi(optarg);
+      break;
+    case 'k':
+      lookups = atoll(optarg);
+      break;
+    default:
+      printf("usage: %s -m <0-%d> -k <lookups>\n", argv[0], _NodeBenchType - 1);
+      exit(-1);
+    }
+  }
+
+  pm_heap.create((char *)alloc_region(SPACE_OF_MAIN_THREAD), SPACE_OF_MAIN_THREAD);
+  dram_arena.init(MEM_OF_MAIN_THREAD);
+
+  switch (bench_type)
+  {
+  case FP_PROBE:
+    fp_probe_bench();
+    break;
+  case FP_HASH_FP:
+    printf("[NODE BENCH]\tfingerprint hash, tree uses %s, ideal %.4f per lookup\n", fp_hash_t::name(),
+           (LEAF_NODE_SIZE - 1) / 256.0);
+    fp_hash_bench<MulShiftHash>();
+    if (__builtin_cpu_supports("sse4.2"))
+      fp_hash_bench<CRC32CHash>();
+    fp_hash_bench<FNVHash>();
+    break;
+  case INNER_PROBE:
+    inner_probe_bench();
+    break;
+  case INNER_COMPACT:
+    inner_compact_bench();
+    break;
+  default:
+    printf("not support such node benchmark: %d\n", bench_type);
+    exit(-1);
+  }
+  return 0;
+}